@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Runs tntbench over the module pairs and over pts bridges, one result
+# line per target and message size.
+#
+#   SIZES   message sizes                     (default "1 64 1024")
+#   COUNT   messages per pair and size        (default 10000)
+#   PAIRS   pairs driven at the same time     (default 1)
+#   MODE    both, tput or lat                 (default both)
+#   TARGETS module, lowlat, noise and/or pts  (default "module lowlat pts")
+#   PTS_OPTS extra options of the pts bridge  (e.g. -z)
+#   NOISE   error rates in ppm for noise      (default "1000000 500000 1000")
+#
+# The module target needs tty0tty loaded with at least PAIRS pairs and is
+# skipped otherwise. lowlat runs the same pairs in low latency mode, for
+# comparing its round trips with the batched pushes of module.
+#
+# noise checks that the module pairs deliver the line error rates they are
+# asked for; it runs the throughput phase once per rate in NOISE and fails
+# if the errors counted are off.
+
+cd "$(dirname "$0")" || exit 1
+
+SIZES=${SIZES:-"1 64 1024"}
+COUNT=${COUNT:-10000}
+PAIRS=${PAIRS:-1}
+MODE=${MODE:-both}
+TARGETS=${TARGETS:-"module lowlat pts"}
+NOISE=${NOISE:-"1000000 500000 1000"}
+
+bench() {
+	label=$1
+	shift
+	for size in $SIZES; do
+		./tntbench -m "$MODE" -s "$size" -n "$COUNT" -l "$label" "$@" ||
+			exit 1
+	done
+}
+
+# module pairs, label and extra tntbench options as arguments
+module_pairs() {
+	label=$1
+	shift
+	devs=
+	i=0
+	while [ $i -lt "$PAIRS" ]; do
+		a=/dev/tnt$((2 * i))
+		b=/dev/tnt$((2 * i + 1))
+		if [ ! -c $a ] || [ ! -c $b ]; then
+			echo "skipping $label: $a or $b missing" >&2
+			return
+		fi
+		devs="$devs $a $b"
+		i=$((i + 1))
+	done
+	bench "$label" "$@" $devs
+}
+
+run_module() {
+	module_pairs module
+}
+
+run_lowlat() {
+	module_pairs module-lowlat -L
+}
+
+run_noise() {
+	for ppm in $NOISE; do
+		(MODE=tput; module_pairs noise-$ppm -e "$ppm") || exit 1
+	done
+}
+
+run_pts() {
+	dir=$(mktemp -d) || exit 1
+	devs=
+	i=0
+	while [ $i -lt "$PAIRS" ]; do
+		devs="$devs $dir/a$i $dir/b$i"
+		i=$((i + 1))
+	done
+	# one bridge process serves all of the pairs
+	../pts/tty0tty $PTS_OPTS $devs >/dev/null &
+	pid=$!
+	for dev in $devs; do
+		while [ ! -e "$dev" ]; do
+			sleep 0.1
+		done
+	done
+	bench pts $devs
+	kill $pid
+	rm -rf "$dir"
+}
+
+for target in $TARGETS; do
+	run_$target
+done
@@ -0,0 +1,533 @@
+/* ########################################################################
+
+   tntbench - throughput and latency benchmark for tty0tty pairs
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   Every pair of devices given on the command line is driven by its own
+   threads, so several pairs measure the driver under concurrency.
+
+   The throughput phase writes count messages to the first device of each
+   pair while a reader thread drains the second one. The latency phase
+   sends count messages one at a time through the pair and back, with an
+   echo thread on the second device, and times each round trip.
+
+   The result is one line of key=value fields on stdout:
+
+   label=.. mode=.. pairs=.. size=.. msgs=.. secs=.. mb_per_s=..
+   msgs_per_s=.. ns_per_write=.. lost=.. rtt_msgs=.. p50_us=.. p99_us=..
+   p999_us=..
+
+   -L switches the module ports to low latency mode (TTY0TTY_LOW_LATENCY)
+   while measuring, to compare it against the default batched pushes.
+
+   -e ppm makes the second module port of each pair receive that many
+   framing errors per million bytes (TTY0TTY_IOCSNOISE) during the
+   throughput phase, and adds the share the driver counted as err_ppm=..
+   to the line. tntbench fails if it is off by more than 2% of ppm plus
+   1000, so use enough bytes for the errors to average out.
+
+   usage: tntbench [-m both|tput|lat] [-s size] [-n count] [-l label] [-L]
+                   [-e ppm] devA devB [devC devD ...]
+
+   ######################################################################## */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include "../module/tty0tty.h"
+
+#define MODE_TPUT 1
+#define MODE_LAT  2
+
+/* give up on a message the pair did not deliver within this time */
+#define RTT_TIMEOUT_NS 1000000000LL
+
+struct pair
+{
+  const char *name_a;
+  const char *name_b;
+  int fda;
+  int fdb;
+  __u32 flags_a;            /* mode flags to restore with -L */
+  __u32 flags_b;
+  int errors;               /* line errors counted on the second device */
+  pthread_t thread;
+  pthread_t peer_thread;
+
+  /* throughput phase */
+  long long written;
+  long long received;
+  long long write_ns;
+
+  /* latency phase */
+  long long *rtt;
+  long rtt_count;
+};
+
+static size_t size = 8;
+static long count = 100000;
+static volatile int done;
+
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+open_raw(const char *name)
+{
+  struct termios params;
+  int fd;
+
+  fd = open(name, O_RDWR | O_NOCTTY);
+  if (fd < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+  tcgetattr(fd, &params);
+  cfmakeraw(&params);
+  params.c_cflag |= (CLOCAL | CREAD);
+  params.c_cc[VMIN] = 0;
+  params.c_cc[VTIME] = 1;
+  tcsetattr(fd, TCSANOW, &params);
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+/* switch a module port to low latency mode, returns the flags it had */
+static __u32
+set_low_latency(int fd, const char *name)
+{
+  __u32 old, mode;
+
+  if (ioctl(fd, TTY0TTY_IOCGFLAGS, &old) < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+  mode = old | TTY0TTY_LOW_LATENCY;
+  if (ioctl(fd, TTY0TTY_IOCSFLAGS, &mode) < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+  return old;
+}
+
+/* have a module port receive ppm framing errors per million bytes */
+static void
+set_noise(int fd, const char *name, __u32 ppm)
+{
+  struct tty0tty_noise noise = { .frame = ppm, .parity = 0 };
+
+  if (ioctl(fd, TTY0TTY_IOCSNOISE, &noise) < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+}
+
+/* framing and parity errors a port counted so far */
+static int
+get_errors(int fd, const char *name)
+{
+  struct serial_icounter_struct icount;
+
+  if (ioctl(fd, TIOCGICOUNT, &icount) < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+  return icount.frame + icount.parity;
+}
+
+/* write all of buf, returns 0 on success */
+static int
+write_full(int fd, const char *buf, size_t len)
+{
+  ssize_t bw;
+
+  while (len > 0)
+  {
+    bw = write(fd, buf, len);
+    if (bw > 0)
+    {
+      buf += bw;
+      len -= bw;
+    }
+    else if (bw < 0 && errno != EINTR && errno != EAGAIN)
+      return -1;
+  }
+  return 0;
+}
+
+/* read len bytes unless the deadline passes first, returns 0 on success */
+static int
+read_full(int fd, char *buf, size_t len, long long deadline)
+{
+  ssize_t br;
+
+  while (len > 0)
+  {
+    br = read(fd, buf, len);
+    if (br > 0)
+    {
+      buf += br;
+      len -= br;
+    }
+    else if (br < 0 && errno != EINTR && errno != EAGAIN)
+      return -1;
+    else if (now_ns() > deadline)
+      return -1;
+  }
+  return 0;
+}
+
+static void *
+drain(void *arg)
+{
+  struct pair *p = arg;
+  char buf[4096];
+  ssize_t br;
+
+  while (!done)
+  {
+    br = read(p->fdb, buf, sizeof(buf));
+    if (br > 0)
+      p->received += br;
+    else if (br < 0 && errno != EINTR && errno != EAGAIN)
+      break;
+  }
+  return NULL;
+}
+
+static void *
+pump(void *arg)
+{
+  struct pair *p = arg;
+  char *frame;
+  long long start;
+  long i;
+
+  frame = malloc(size);
+  memset(frame, 'U', size);
+
+  start = now_ns();
+  for (i = 0; i < count; i++)
+  {
+    if (write_full(p->fda, frame, size) < 0)
+    {
+      perror("write");
+      break;
+    }
+  }
+  p->write_ns = now_ns() - start;
+  p->written = (long long) size * i;
+
+  free(frame);
+  return NULL;
+}
+
+static void *
+echo(void *arg)
+{
+  struct pair *p = arg;
+  char buf[4096];
+  ssize_t br;
+
+  while (!done)
+  {
+    br = read(p->fdb, buf, sizeof(buf));
+    if (br > 0)
+    {
+      if (write_full(p->fdb, buf, br) < 0)
+        break;
+    }
+    else if (br < 0 && errno != EINTR && errno != EAGAIN)
+      break;
+  }
+  return NULL;
+}
+
+static void *
+ping(void *arg)
+{
+  struct pair *p = arg;
+  char *frame;
+  char *back;
+  long long start;
+  long i;
+
+  frame = malloc(size);
+  back = malloc(size);
+  memset(frame, 'U', size);
+
+  p->rtt = malloc(count * sizeof(*p->rtt));
+  p->rtt_count = 0;
+  for (i = 0; i < count; i++)
+  {
+    start = now_ns();
+    if (write_full(p->fda, frame, size) < 0 ||
+        read_full(p->fda, back, size, start + RTT_TIMEOUT_NS) < 0)
+    {
+      fprintf(stderr, "%s: round trip %ld lost\n", p->name_a, i);
+      break;
+    }
+    p->rtt[p->rtt_count++] = now_ns() - start;
+  }
+
+  free(frame);
+  free(back);
+  return NULL;
+}
+
+static void
+run_phase(struct pair *pairs, int npairs, void *(*fn)(void *),
+          void *(*peer_fn)(void *))
+{
+  int i;
+
+  done = 0;
+  for (i = 0; i < npairs; i++)
+  {
+    tcflush(pairs[i].fda, TCIOFLUSH);
+    tcflush(pairs[i].fdb, TCIOFLUSH);
+    pthread_create(&pairs[i].peer_thread, NULL, peer_fn, &pairs[i]);
+  }
+  for (i = 0; i < npairs; i++)
+    pthread_create(&pairs[i].thread, NULL, fn, &pairs[i]);
+  for (i = 0; i < npairs; i++)
+    pthread_join(pairs[i].thread, NULL);
+}
+
+static void
+stop_phase(struct pair *pairs, int npairs)
+{
+  int i;
+
+  done = 1;
+  for (i = 0; i < npairs; i++)
+    pthread_join(pairs[i].peer_thread, NULL);
+}
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile_us(long long *v, long n, double pct)
+{
+  long i;
+
+  if (n == 0)
+    return 0;
+  i = (long) (pct * n / 100.0);
+  if (i >= n)
+    i = n - 1;
+  return v[i] / 1000.0;
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-m both|tput|lat] [-s size] [-n count] "
+          "[-l label] [-L] [-e ppm] devA devB [devC devD ...]\n", name);
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  const char *label = "tnt";
+  const char *mode_name = "both";
+  int mode = MODE_TPUT | MODE_LAT;
+  int low_latency = 0;
+  long noise = -1;
+  long long errors = 0;
+  double err_ppm = 0;
+  int status = EXIT_SUCCESS;
+  struct pair *pairs;
+  int npairs;
+  int i;
+  int opt;
+  long long start, elapsed = 0, deadline;
+  long long written = 0, received = 0, write_ns = 0;
+  long long *rtt = NULL;
+  long rtt_count = 0;
+
+  while ((opt = getopt(argc, argv, "m:s:n:l:Le:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      mode_name = optarg;
+      if (!strcmp(optarg, "tput"))
+        mode = MODE_TPUT;
+      else if (!strcmp(optarg, "lat"))
+        mode = MODE_LAT;
+      else if (!strcmp(optarg, "both"))
+        mode = MODE_TPUT | MODE_LAT;
+      else
+        usage(argv[0]);
+      break;
+    case 's':
+      size = strtoul(optarg, NULL, 0);
+      break;
+    case 'n':
+      count = strtol(optarg, NULL, 0);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'L':
+      low_latency = 1;
+      break;
+    case 'e':
+      noise = strtol(optarg, NULL, 0);
+      if (noise < 0 || noise > TTY0TTY_NOISE_MAX)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2 || (argc - optind) % 2 || size == 0 || count <= 0)
+    usage(argv[0]);
+
+  npairs = (argc - optind) / 2;
+  pairs = calloc(npairs, sizeof(*pairs));
+  for (i = 0; i < npairs; i++)
+  {
+    pairs[i].name_a = argv[optind + 2 * i];
+    pairs[i].name_b = argv[optind + 2 * i + 1];
+    pairs[i].fda = open_raw(pairs[i].name_a);
+    pairs[i].fdb = open_raw(pairs[i].name_b);
+    if (low_latency)
+    {
+      pairs[i].flags_a = set_low_latency(pairs[i].fda, pairs[i].name_a);
+      pairs[i].flags_b = set_low_latency(pairs[i].fdb, pairs[i].name_b);
+    }
+  }
+
+  if (mode & MODE_TPUT)
+  {
+    for (i = 0; noise >= 0 && i < npairs; i++)
+    {
+      set_noise(pairs[i].fdb, pairs[i].name_b, noise);
+      pairs[i].errors = get_errors(pairs[i].fdb, pairs[i].name_b);
+    }
+
+    start = now_ns();
+    run_phase(pairs, npairs, pump, drain);
+
+    /* wait for the tail still queued in the pairs, then stop the readers */
+    deadline = now_ns() + RTT_TIMEOUT_NS;
+    for (i = 0; i < npairs; i++)
+      while (pairs[i].received < pairs[i].written && now_ns() < deadline)
+        usleep(1000);
+    elapsed = now_ns() - start;
+    stop_phase(pairs, npairs);
+
+    for (i = 0; i < npairs; i++)
+    {
+      written += pairs[i].written;
+      received += pairs[i].received;
+      write_ns += pairs[i].write_ns;
+      if (noise >= 0)
+      {
+        errors += get_errors(pairs[i].fdb, pairs[i].name_b) -
+                  pairs[i].errors;
+        set_noise(pairs[i].fdb, pairs[i].name_b, 0);
+      }
+    }
+    if (received)
+      err_ppm = errors * (double) TTY0TTY_NOISE_MAX / received;
+  }
+
+  if (mode & MODE_LAT)
+  {
+    run_phase(pairs, npairs, ping, echo);
+    stop_phase(pairs, npairs);
+
+    rtt = malloc(npairs * count * sizeof(*rtt));
+    for (i = 0; i < npairs; i++)
+    {
+      memcpy(rtt + rtt_count, pairs[i].rtt,
+             pairs[i].rtt_count * sizeof(*rtt));
+      rtt_count += pairs[i].rtt_count;
+      free(pairs[i].rtt);
+    }
+    qsort(rtt, rtt_count, sizeof(*rtt), cmp_ll);
+  }
+
+  printf("label=%s mode=%s pairs=%d size=%zu msgs=%lld secs=%.3f "
+         "mb_per_s=%.2f msgs_per_s=%.0f ns_per_write=%.1f lost=%lld "
+         "rtt_msgs=%ld p50_us=%.1f p99_us=%.1f p999_us=%.1f",
+         label, mode_name, npairs, size, received / (long long) size,
+         elapsed / 1e9,
+         elapsed ? received * 1000.0 / elapsed : 0,
+         elapsed ? received / (double) size * 1e9 / elapsed : 0,
+         written ? (double) write_ns * size / written : 0,
+         written - received, rtt_count,
+         percentile_us(rtt, rtt_count, 50),
+         percentile_us(rtt, rtt_count, 99),
+         percentile_us(rtt, rtt_count, 99.9));
+  if (noise >= 0 && (mode & MODE_TPUT))
+  {
+    printf(" err_ppm=%.0f", err_ppm);
+    if (err_ppm < noise - noise / 50.0 - 1000 ||
+        err_ppm > noise + noise / 50.0 + 1000)
+    {
+      fprintf(stderr, "%s: %.0f errors per million bytes, asked for %ld\n",
+              label, err_ppm, noise);
+      status = EXIT_FAILURE;
+    }
+  }
+  printf("\n");
+
+  for (i = 0; i < npairs; i++)
+  {
+    if (low_latency)
+    {
+      ioctl(pairs[i].fda, TTY0TTY_IOCSFLAGS, &pairs[i].flags_a);
+      ioctl(pairs[i].fdb, TTY0TTY_IOCSFLAGS, &pairs[i].flags_b);
+    }
+    close(pairs[i].fda);
+    close(pairs[i].fdb);
+  }
+  free(pairs);
+  free(rtt);
+
+  return status;
+}
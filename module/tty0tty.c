@@ -13,6 +13,18 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/cache.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
 #include <linux/wait.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
@@ -24,14 +36,100 @@
 #include <linux/sched/signal.h>
 #endif
 #include <linux/uaccess.h>
+#include <linux/jump_label.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/anon_inodes.h>
+#include <linux/eventfd.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/rculist.h>
+#include <linux/random.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/bitops.h>
+#include <asm/unaligned.h>
+
+#include "tty0tty.h"
+
+#define CREATE_TRACE_POINTS
+#include "tty0tty_trace.h"
 
 #define DRIVER_VERSION "v1.3"
+#define DRIVER_DESC "tty0tty null modem driver"
 
 //Default number of pairs of devices
 short pairs = 4;
 module_param(pairs, short, 0440);
 MODULE_PARM_DESC(pairs,
-		 "Number of pairs of devices to be created, maximum of 128");
+		 "Number of pairs of devices created at load, maximum of max_pairs");
+
+//Default limit of pairs existing at the same time
+static unsigned int max_pairs = 128;
+module_param(max_pairs, uint, 0444);
+MODULE_PARM_DESC(max_pairs,
+		 "Number of pairs that can exist at the same time, maximum of 16384");
+
+//Default size of the transmit FIFO of each device
+static unsigned int fifo_size = 4096;
+module_param(fifo_size, uint, 0444);
+MODULE_PARM_DESC(fifo_size,
+		 "Transmit FIFO size in bytes, rounded up to a power of two");
+
+//Default flip buffer coalescing, disabled
+static unsigned int coalesce_bytes;
+module_param(coalesce_bytes, uint, 0444);
+MODULE_PARM_DESC(coalesce_bytes,
+		 "Bytes to collect before pushing to the reader, 0 pushes on every write");
+
+static unsigned int coalesce_usecs = 1000;
+module_param(coalesce_usecs, uint, 0444);
+MODULE_PARM_DESC(coalesce_usecs,
+		 "Longest time collected bytes wait for a push, in microseconds");
+
+//Default line pacing, disabled
+static bool pacing;
+module_param(pacing, bool, 0444);
+MODULE_PARM_DESC(pacing,
+		 "Deliver data at the speed of the configured line instead of memory speed");
+
+static unsigned int pacing_slice_usecs = 1000;
+module_param(pacing_slice_usecs, uint, 0444);
+MODULE_PARM_DESC(pacing_slice_usecs,
+		 "Interval between paced transmit batches, in microseconds");
+
+//Default size of the capture ring of each CPU while a pair is tapped
+static unsigned int tap_size = 65536;
+module_param(tap_size, uint, 0444);
+MODULE_PARM_DESC(tap_size,
+		 "Bytes of the per-CPU capture ring of a tapped pair, rounded up to a power of two");
+
+//Default size of each direction of the shared ring of a pair
+static unsigned int ring_size = 65536;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size,
+		 "Bytes of each direction of a pair's shared ring, rounded up to a power of two");
+
+//Default of placing pairs and their FIFOs near whoever uses them first
+static int pair_node = NUMA_NO_NODE;
+module_param(pair_node, int, 0444);
+MODULE_PARM_DESC(pair_node,
+		 "NUMA node of the pairs created at load, -1 for the local node (default -1)");
+
+//Default of not timing writes for the latency histograms
+static bool latency_hist;
+static int tty0tty_set_latency_hist(const char *val,
+				    const struct kernel_param *kp);
+static const struct kernel_param_ops tty0tty_latency_hist_ops = {
+	.set = tty0tty_set_latency_hist,
+	.get = param_get_bool,
+};
+module_param_cb(latency_hist, &tty0tty_latency_hist_ops, &latency_hist, 0644);
+MODULE_PARM_DESC(latency_hist,
+		 "Collect the write to push latency histograms in debugfs");
 
 #define TTY0TTY_MAJOR		0	/* dynamic allocation */
 #define TTY0TTY_MINOR		0
@@ -47,505 +145,2931 @@ MODULE_PARM_DESC(pairs,
 #define MSR_DSR		0x40
 #define MSR_RI		0x80
 
-static struct tty_port *tport;
+/* data path accounting, kept per CPU and summed when read */
+struct tty0tty_stats {
+	unsigned long tx;	/* bytes sent to the peer */
+	unsigned long rx;	/* bytes received from the peer */
+	unsigned long dropped;	/* bytes lost because the peer was closed */
+};
+
+struct tty0tty_pair;
+
+/*
+ * The termios of a port as the data path uses it, worked out once by
+ * set_termios instead of being decoded again per character.
+ */
+struct tty0tty_line {
+	u64 frame_ns;		/* time to send one character, 0 at B0 */
+	unsigned int baud;
+	u8 frame_bits;		/* start, data, parity and stop bits */
+	u8 flow;		/* TTY0TTY_LINE_* */
+	u8 stop_char;
+	u8 start_char;
+};
+
+#define TTY0TTY_LINE_RTSCTS	0x01	/* only send while CTS is up */
+#define TTY0TTY_LINE_IXON	0x02	/* XON/XOFF received pause the peer */
+#define TTY0TTY_LINE_IXOFF	0x04	/* throttling sends XON/XOFF */
+#define TTY0TTY_LINE_IXANY	0x08	/* with IXON, any byte resumes */
+
+/* bucket b counts latencies of 2^(b-1) to 2^b - 1 ns, the last one more */
+#define TTY0TTY_LAT_BUCKETS	40
+#define TTY0TTY_LAT_MARKS	16
+
+/* writes up to this size are delivered directly in low latency mode */
+#define TTY0TTY_DIRECT_MAX	256
+
+/* a write whose last byte is byte seq of the port, and when it came */
+struct tty0tty_mark {
+	u64 seq;
+	u64 time_ns;
+};
+
+/*
+ * A capture of a pair's traffic: one ring per possible CPU, laid out as
+ * described in tty0tty.h and mapped by the process that attached it.
+ */
+struct tty0tty_tap {
+	struct tty0tty_pair *pair;	/* holds a reference */
+	void *area;			/* nr_cpu_ids rings of stride bytes */
+	size_t stride;
+	u64 __percpu *head;		/* producer heads, published to rings */
+	wait_queue_head_t wait;		/* readers polling for records */
+};
+
+/*
+ * A multi-drop bus: what one member writes goes to all of the others
+ * instead of to its pair peer. Exists while it has members.
+ */
+struct tty0tty_bus {
+	struct list_head node;		/* in tty0tty_buses */
+	struct list_head members;	/* RCU list of ports */
+	u32 id;
+};
 
+/*
+ * One end of a pair. The fields a writer on the other end touches on
+ * every write come first, the ones used by this end's own writer get a
+ * cache line of their own, and open/close and ioctl state comes last.
+ */
 struct tty0tty_serial {
+	/* receive side, taken by the peer's writer */
+	spinlock_t lock;	/* protects tty and active for the writer */
+	bool active;		/* open, from activate to shutdown */
 	struct tty_struct *tty;	/* pointer to the tty for this device */
-	int open_count;		/* number of times this port has been opened */
-	struct semaphore sem;	/* locks this structure */
+	struct tty0tty_serial *peer;	/* other end of the pair */
+	bool throttled;		/* the ldisc asked the peer to hold off */
+	bool ring_attached;	/* receives through the shared ring */
+	struct eventfd_ctx *ring_efd;	/* signalled when the ring changed */
+	wait_queue_head_t ring_wait;	/* pollers of the ring file */
 
 	/* for tiocmget and tiocmset functions */
-	int msr;		/* MSR shadow */
-	int mcr;		/* MCR shadow */
+	int msr;		/* MSR shadow, changed under lock */
+	int mcr;		/* MCR shadow, changed under lock */
+	struct async_icount icount;	/* protected by lock */
+	struct tty0tty_stats __percpu *stats;
+	struct tty0tty_bus __rcu *bus;	/* writes go to this bus, if set */
+	struct list_head bus_node;	/* in bus->members */
+	struct tty0tty_noise noise;	/* injected line errors, under lock */
+	u32 noise_left;		/* good bytes before the next error */
+
+	/*
+	 * transmit side, data written to this port and not yet taken by the
+	 * peer; xmit_lock protects it and nests outside the peer's lock
+	 */
+	spinlock_t xmit_lock ____cacheline_aligned_in_smp;
+	DECLARE_KFIFO_PTR(xmit, unsigned char);
+
+	/* tuning of TTY0TTY_IOCSCONFIG, all under xmit_lock */
+	unsigned int xmit_size;		/* bytes of the FIFO */
+	unsigned int baud_base;		/* fastest line rate, 0 for any */
+
+	/* flip buffer coalescing, all under xmit_lock */
+	bool low_latency;	/* push at once, small writes go directly */
+	unsigned int coalesce_bytes;	/* push threshold, 0 when disabled */
+	unsigned int coalesce_usecs;	/* latency budget of unpushed bytes */
+	unsigned int tx_unpushed;	/* bytes inserted since the last push */
+
+	/* written with both xmit_lock and lock held, either one reads it */
+	struct tty0tty_line line;
+
+	/* flow control, all under xmit_lock */
+	bool tx_stopped;	/* the last drain was held off by the peer */
+	bool tx_overrun;	/* the peer's flip buffer is full, counted */
+	bool xoff;		/* paused by XOFF, set without xmit_lock */
+
+	/* latency histogram, all under xmit_lock */
+	u64 tx_queued;		/* bytes ever put in the FIFO */
+	u64 tx_sent;		/* bytes ever taken out of it */
+	DECLARE_KFIFO(tx_marks, struct tty0tty_mark, TTY0TTY_LAT_MARKS);
+	u64 lat_hist[TTY0TTY_LAT_BUCKETS];
+
+	/* line pacing, all under xmit_lock */
+	bool pacing;		/* drain at line speed */
+	bool tx_active;		/* tx_timer owns draining the FIFO */
+	u64 tx_credit_ns;	/* line time not yet spent on a character */
+	ktime_t tx_last;	/* when tx_credit_ns was last brought up to date */
+
+	struct hrtimer push_timer;	/* pushes when the budget runs out */
+	struct hrtimer tx_timer;	/* drains one slice worth of data */
+	struct delayed_work tx_work;	/* retries a drain the peer refused */
+
+	/* open, close and ioctl state */
+	struct tty_port port;
+	struct tty0tty_pair *pair;	/* pair this device belongs to */
+	int index;		/* tty index of this device */
+	wait_queue_head_t wait;	/* TIOCMIWAIT sleepers, woken on MSR changes */
+	struct dentry *debugfs;	/* latency histogram */
+} ____cacheline_aligned_in_smp;
 
-	/* for ioctl fun */
-	struct serial_struct serial;
-	wait_queue_head_t wait;
-	struct async_icount icount;
+/*
+ * Pairs are created at load or through the control device, and freed once
+ * both of their tty_ports have dropped the last reference. Both ends sit
+ * next to each other, each starting on its own cache line.
+ */
+struct tty0tty_pair {
+	struct tty0tty_serial serial[2];
+
+	/* for ioctl fun, kept out of the way of the data path */
+	struct serial_struct serial_info[2];
+
+	struct tty0tty_tap __rcu *tap;	/* only looked at while any is set */
+
+	/* shared ring area, from the first TTY0TTY_IOCRING to the release */
+	void *ring_area;
+
+	unsigned long direct;	/* bit 0 while a direct delivery runs */
+
+	struct kref kref;	/* one reference per tty_port */
+	unsigned int index;	/* devices are tnt(2 * index) and the next one */
+	int node;		/* NUMA node set at creation, or NUMA_NO_NODE */
+	bool dead;		/* destroyed, hung up ttys must not reopen */
 };
 
-static struct tty0tty_serial **tty0tty_table;	/* initially all NULL */
+static struct kmem_cache *tty0tty_pair_cache;
+static struct tty0tty_pair **tty0tty_pairs;	/* max_pairs slots */
+static DEFINE_MUTEX(tty0tty_pairs_lock);	/* protects tty0tty_pairs */
+
+/*
+ * A destroyed pair keeps its slot until its last reference is dropped,
+ * so that the number is not reused while hung up ttys of the old one are
+ * still installed. Called with tty0tty_pairs_lock held.
+ */
+static struct tty0tty_pair *tty0tty_pair_lookup(int index)
+{
+	struct tty0tty_pair *pair = tty0tty_pairs[index];
+
+	return pair && !pair->dead ? pair : NULL;
+}
+
+static LIST_HEAD(tty0tty_buses);	/* protected by tty0tty_pairs_lock */
+
+/* enabled while any bus exists, writes of pairs do not look for one else */
+static DEFINE_STATIC_KEY_FALSE(tty0tty_bus_key);
+
+/* enabled while any pair is tapped, so that writes skip the tap otherwise */
+static DEFINE_STATIC_KEY_FALSE(tty0tty_tap_key);
+
+/* enabled while any port injects line errors, drains skip them else */
+static DEFINE_STATIC_KEY_FALSE(tty0tty_noise_key);
+
+/* enabled with latency_hist, writes are only timed while it is */
+static DEFINE_STATIC_KEY_FALSE(tty0tty_lat_key);
+
+static struct dentry *tty0tty_debugfs;	/* tty0tty/ in debugfs */
+
+static int tty0tty_set_latency_hist(const char *val,
+				    const struct kernel_param *kp)
+{
+	int retval = param_set_bool(val, kp);
+
+	if (retval)
+		return retval;
+
+	if (latency_hist)
+		static_branch_enable(&tty0tty_lat_key);
+	else
+		static_branch_disable(&tty0tty_lat_key);
+	return 0;
+}
+
+/*
+ * Both ends are allocated with the pair, so the peer stays valid as long
+ * as the caller holds its own port; whether it is open has to be checked
+ * by the caller.
+ */
+static struct tty0tty_serial *get_peer(struct tty0tty_serial *tts)
+{
+	return tts->peer;
+}
 
 static struct tty0tty_serial *get_counterpart(struct tty0tty_serial *tts)
 {
-	int idx = tts->tty->index;
-	int counterpart_idx = idx + 1;
+	struct tty0tty_serial *peer = get_peer(tts);
+
+	if (READ_ONCE(peer->active))
+		return peer;
+
+	return NULL;
+}
+
+static void tty0tty_get_stats(struct tty0tty_serial *tty0tty,
+			      struct tty0tty_stats *sum)
+{
+	struct tty0tty_stats *stats;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(tty0tty->stats, cpu);
+		sum->tx += stats->tx;
+		sum->rx += stats->rx;
+		sum->dropped += stats->dropped;
+	}
+}
+
+/*
+ * Remember when the bytes queued up to now came; there are marks for a
+ * few writes at a time, the others are not timed. Called with xmit_lock
+ * held.
+ */
+static void tty0tty_lat_queued(struct tty0tty_serial *tty0tty,
+			       unsigned int count)
+{
+	struct tty0tty_mark mark;
+
+	tty0tty->tx_queued += count;
+	if (!static_branch_unlikely(&tty0tty_lat_key) || !count ||
+	    kfifo_is_full(&tty0tty->tx_marks))
+		return;
+
+	mark.seq = tty0tty->tx_queued;
+	mark.time_ns = ktime_get_ns();
+	kfifo_put(&tty0tty->tx_marks, mark);
+}
+
+/*
+ * Everything taken out of the FIFO so far has reached the peer: count the
+ * writes that are complete now. Called with xmit_lock held.
+ */
+static void tty0tty_lat_sent(struct tty0tty_serial *tty0tty)
+{
+	struct tty0tty_mark mark;
+	u64 now;
+
+	if (kfifo_is_empty(&tty0tty->tx_marks))
+		return;
+
+	now = ktime_get_ns();
+	while (kfifo_peek(&tty0tty->tx_marks, &mark) &&
+	       mark.seq <= tty0tty->tx_sent) {
+		kfifo_skip(&tty0tty->tx_marks);
+		tty0tty->lat_hist[min(fls64(now - mark.time_ns),
+				      TTY0TTY_LAT_BUCKETS - 1)]++;
+	}
+}
+
+/* the queued bytes are gone without reaching the peer */
+static void tty0tty_lat_discard(struct tty0tty_serial *tty0tty)
+{
+	tty0tty->tx_sent = tty0tty->tx_queued;
+	kfifo_reset(&tty0tty->tx_marks);
+}
+
+/* throw away what is queued for the peer; called with xmit_lock held */
+static void tty0tty_tx_discard(struct tty0tty_serial *tty0tty)
+{
+	unsigned int len = kfifo_len(&tty0tty->xmit);
+
+	if (len)
+		trace_tty0tty_drop(tty0tty->index, len);
+	this_cpu_add(tty0tty->stats->dropped, len);
+	kfifo_reset_out(&tty0tty->xmit);
+	tty0tty_lat_discard(tty0tty);
+}
+
+/* CRTSCTS keeps tty0tty from sending, called with xmit_lock held */
+static bool tty0tty_cts_held(struct tty0tty_serial *tty0tty)
+{
+	return tty0tty->line.flow & TTY0TTY_LINE_RTSCTS &&
+		!(READ_ONCE(tty0tty->msr) & MSR_CTS);
+}
 
-	if (idx % 2)
-		counterpart_idx = idx - 1;
+static void tty0tty_tx_restart(struct tty0tty_serial *tty0tty);
+static void tty0tty_ring_kicked(struct tty0tty_serial *tty0tty);
 
-	if (tty0tty_table[counterpart_idx] &&
-				tty0tty_table[counterpart_idx]->open_count > 0)
-		return tty0tty_table[counterpart_idx];
+/*
+ * Find the last a or b in buf, a word at a time: a byte of the word
+ * matches when the same byte of (word ^ pattern) is zero.
+ */
+static const unsigned char *tty0tty_scan_xchar(const unsigned char *buf,
+					       size_t len, unsigned char a,
+					       unsigned char b)
+{
+	const unsigned long ones = REPEAT_BYTE(0x01);
+	const unsigned long highs = REPEAT_BYTE(0x80);
+	unsigned long pa = REPEAT_BYTE(a);
+	unsigned long pb = REPEAT_BYTE(b);
+	unsigned long v, x, y;
+	size_t i = len;
+	size_t j;
+
+	for (; i >= sizeof(v); i -= sizeof(v)) {
+		v = get_unaligned((const unsigned long *)(buf + i - sizeof(v)));
+		x = v ^ pa;
+		y = v ^ pb;
+		if ((((x - ones) & ~x) | ((y - ones) & ~y)) & highs)
+			break;
+	}
+	/* the match is in the word before i, or in the bytes before it */
+	for (j = i; j > 0; j--)
+		if (buf[j - 1] == a || buf[j - 1] == b)
+			return buf + j - 1;
 
 	return NULL;
 }
 
-static int tty0tty_open(struct tty_struct *tty, struct file *file)
+/*
+ * XON/XOFF handling for data that just reached tts: with IXON the last
+ * STOP or START char in it pauses or resumes what tts sends, right away
+ * instead of once its ldisc got to the data. The chars are still passed
+ * on, the ldisc calling .stop/.start again changes nothing. Called with
+ * tts->lock held; tts->xmit_lock may be taken by the peer's drain, so the
+ * resumed transmitter is only scheduled.
+ */
+static void tty0tty_rx_xchars(struct tty0tty_serial *tts,
+			      const unsigned char *buf, size_t len)
 {
-	struct tty0tty_serial *tty0tty;
-	int index;
-	int msr = 0;
-	int mcr = 0;
-	struct tty0tty_serial *tts;
+	const unsigned char *c;
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
+	bool ixany = tts->line.flow & TTY0TTY_LINE_IXANY;
 
-	/* initialize the pointer in case something fails */
-	tty->driver_data = NULL;
+	if (!(tts->line.flow & TTY0TTY_LINE_IXON) || !len)
+		return;
 
-	/* get the serial object associated with this tty pointer */
-	index = tty->index;
-	tty0tty = tty0tty_table[index];
-	if (tty0tty == NULL) {
-		/* first time accessing this device, let's create it */
-		tty0tty = kzalloc(sizeof(*tty0tty), GFP_KERNEL);
-		if (!tty0tty)
-			return -ENOMEM;
+	c = tty0tty_scan_xchar(buf, len, tts->line.stop_char,
+			       tts->line.start_char);
+	if (c && *c == tts->line.stop_char && (!ixany || c == buf + len - 1)) {
+		WRITE_ONCE(tts->xoff, true);
+	} else if ((c || ixany) && READ_ONCE(tts->xoff)) {
+		WRITE_ONCE(tts->xoff, false);
+		schedule_delayed_work(&tts->tx_work, 0);
+	}
+}
 
-		sema_init(&tty0tty->sem, 1);
-		tty0tty->open_count = 0;
+/* draw the number of good bytes tts receives before the next error */
+static void tty0tty_noise_next(struct tty0tty_serial *tts)
+{
+	u32 rate = tts->noise.frame + tts->noise.parity;
+	u32 gap;
 
-		tty0tty_table[index] = tty0tty;
+	if (!rate) {
+		tts->noise_left = 0;
+		return;
 	}
 
-	tport[index].tty = tty;
-	tty->port = &tport[index];
+	/*
+	 * An error and its gap take M / rate bytes on average, so the gap
+	 * averages M / rate - 1. It is drawn uniform over twice that, so
+	 * errors do not come in lockstep, in units of 1 / rate byte and
+	 * dithered before rounding down, which keeps the mean exact where
+	 * M / rate is not a whole number.
+	 */
+	gap = prandom_u32_max(2 * (TTY0TTY_NOISE_MAX - rate) + 1);
+	tts->noise_left = (gap + prandom_u32_max(rate)) / rate;
+}
 
-	tts = get_counterpart(tty0tty);
-	if (tts)
-		mcr = tts->mcr;
+/*
+ * Line noise: the next byte of tty0tty reaches tts with a framing or a
+ * parity error, picked by their share of the rate, and is counted as one.
+ * Returns false if the flip buffer of tts has no room for it. Called with
+ * xmit_lock of tty0tty and tts->lock held.
+ */
+static bool tty0tty_rx_noise(struct tty0tty_serial *tty0tty,
+			     struct tty0tty_serial *tts)
+{
+	struct tty_port *port = tts->tty->port;
+	unsigned char ch;
+	u32 rate = tts->noise.frame + tts->noise.parity;
+
+	if (tty_buffer_request_room(port, 1) < 1)
+		return false;
+	if (!kfifo_get(&tty0tty->xmit, &ch))
+		return false;
+
+	if (prandom_u32_max(rate) < tts->noise.frame) {
+		tty_insert_flip_char(port, ch, TTY_FRAME);
+		tts->icount.frame++;
+	} else {
+		tty_insert_flip_char(port, ch, TTY_PARITY);
+		tts->icount.parity++;
+	}
+	tty0tty_noise_next(tts);
+	return true;
+}
+
+/*
+ * Set and clear MSR bits of tts. Every transition is counted in icount
+ * and wakes TIOCMIWAIT sleepers, the same as a modem status interrupt on
+ * a real UART.
+ */
+static void tty0tty_update_msr(struct tty0tty_serial *tts,
+			       unsigned int set, unsigned int clear)
+{
+	unsigned int delta;
+	unsigned long flags;
+	unsigned int msr;
+
+	spin_lock_irqsave(&tts->lock, flags);
+	msr = (tts->msr & ~clear) | set;
+	delta = tts->msr ^ msr;
+	tts->msr = msr;
+	if (delta)
+		trace_tty0tty_modem(tts->index, msr, delta);
+	if (delta & MSR_CTS)
+		tts->icount.cts++;
+	if (delta & MSR_DSR)
+		tts->icount.dsr++;
+	if (delta & MSR_CD)
+		tts->icount.dcd++;
+	if (delta & MSR_RI)
+		tts->icount.rng++;
+	spin_unlock_irqrestore(&tts->lock, flags);
+
+	if (delta)
+		wake_up_interruptible(&tts->wait);
+
+	/* CTS came up, data held back by hardware flow control may go */
+	if (delta & msr & MSR_CTS)
+		tty0tty_tx_restart(tts);
+}
+
+/* change the TIOCM_* output lines of tty0tty, and so the peer's inputs */
+static void tty0tty_update_mcr(struct tty0tty_serial *tty0tty,
+			       unsigned int set, unsigned int clear)
+{
+	struct tty0tty_serial *tts = get_counterpart(tty0tty);
+	unsigned int msr_set = 0;
+	unsigned int msr_clear = 0;
+	unsigned long flags;
 
 	//null modem connection
 
-	if (mcr & MCR_RTS)
-		msr |= MSR_CTS;
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	if (set & TIOCM_RTS) {
+		tty0tty->mcr |= MCR_RTS;
+		msr_set |= MSR_CTS;
+	}
 
-	if (mcr & MCR_DTR) {
-		msr |= MSR_DSR;
-		msr |= MSR_CD;
+	if (set & TIOCM_DTR) {
+		tty0tty->mcr |= MCR_DTR;
+		msr_set |= MSR_DSR | MSR_CD;
 	}
 
-	tty0tty->msr = msr;
-	tty0tty->mcr = 0;
+	if (clear & TIOCM_RTS) {
+		tty0tty->mcr &= ~MCR_RTS;
+		msr_clear |= MSR_CTS;
+	}
 
-	/* register the tty driver */
+	if (clear & TIOCM_DTR) {
+		tty0tty->mcr &= ~MCR_DTR;
+		msr_clear |= MSR_DSR | MSR_CD;
+	}
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
 
-	down(&tty0tty->sem);
+	if (tts)
+		tty0tty_update_msr(tts, msr_set, msr_clear);
+}
 
-	/* save our structure within the tty structure */
-	tty->driver_data = tty0tty;
-	tty0tty->tty = tty;
+/*
+ * With coalescing enabled, pushing is left to push_timer until enough
+ * bytes are collected, so a stream of tiny writes wakes the reader once
+ * per batch instead of once per write. Called with xmit_lock held.
+ */
+static bool tty0tty_tx_push_due(struct tty0tty_serial *tty0tty,
+				unsigned int moved)
+{
+	tty0tty->tx_unpushed += moved;
 
-	++tty0tty->open_count;
+	if (!tty0tty->coalesce_bytes || tty0tty->low_latency ||
+	    tty0tty->tx_unpushed >= tty0tty->coalesce_bytes) {
+		tty0tty->tx_unpushed = 0;
+		hrtimer_try_to_cancel(&tty0tty->push_timer);
+		return true;
+	}
 
-	up(&tty0tty->sem);
-	return 0;
+	if (!hrtimer_is_queued(&tty0tty->push_timer))
+		hrtimer_start(&tty0tty->push_timer,
+			      ns_to_ktime((u64)tty0tty->coalesce_usecs *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	return false;
 }
 
-static void do_close(struct tty0tty_serial *tty0tty)
+static struct tty0tty_tap_ring *tty0tty_tap_ring(struct tty0tty_tap *tap,
+						 unsigned int cpu)
 {
-	unsigned int msr = 0;
+	return tap->area + cpu * tap->stride;
+}
 
-	struct tty0tty_serial *tts = get_counterpart(tty0tty);
+/*
+ * Append one record to the ring of this CPU, or count it as lost if the
+ * reader has not made room for it. Records never wrap: the rest of the
+ * ring is skipped with a TTY0TTY_TAP_WRAP record instead. The reader can
+ * write to the whole mapping, so head is kept in *headp and only copied
+ * to the ring; tail is the one thing taken from it, and a bad one can
+ * only lose or overwrite records. Called with interrupts off, nothing
+ * else writes to this ring meanwhile.
+ */
+static void tty0tty_tap_put(struct tty0tty_tap_ring *ring, u64 *headp,
+			    unsigned int port, u64 time_ns,
+			    const unsigned char *buf, unsigned int len)
+{
+	struct tty0tty_tap_rec *rec;
+	void *data = (void *)ring + PAGE_SIZE;
+	u64 head = *headp;
+	u64 tail = smp_load_acquire(&ring->tail);
+	u32 need = ALIGN(sizeof(*rec) + len, TTY0TTY_TAP_ALIGN);
+	u32 pos = head & (tap_size - 1);
+	u32 skip = tap_size - pos < need ? tap_size - pos : 0;
+
+	if (head + skip + need - tail > tap_size) {
+		WRITE_ONCE(ring->lost, ring->lost + 1);
+		return;
+	}
+
+	if (skip) {
+		rec = data + pos;
+		rec->len = 0;
+		rec->flags = TTY0TTY_TAP_WRAP;
+		head += skip;
+		pos = 0;
+	}
 
-	dev_dbg(tty0tty->tty->dev, "%s -\n", __func__);
+	rec = data + pos;
+	rec->time_ns = time_ns;
+	rec->len = len;
+	rec->port = port;
+	rec->flags = 0;
+	memcpy(rec + 1, buf, len);
 
-	if (tts)
-		tts->msr = msr;
+	*headp = head + need;
+	smp_store_release(&ring->head, *headp);
+}
 
-	down(&tty0tty->sem);
+/* copy what was just queued by tty0tty to the tap of its pair, if any */
+static void tty0tty_tap_record(struct tty0tty_serial *tty0tty,
+			       const unsigned char *buf, unsigned int len)
+{
+	struct tty0tty_tap_ring *ring;
+	struct tty0tty_tap *tap;
+	unsigned int max;
+	unsigned int n;
+	u64 *head;
+	u64 now;
+
+	rcu_read_lock();
+	tap = rcu_dereference(tty0tty->pair->tap);
+	if (!tap || !len)
+		goto out;
+
+	ring = tty0tty_tap_ring(tap, smp_processor_id());
+	head = this_cpu_ptr(tap->head);
+	/* big writes are split so that a record fits in half of the ring */
+	max = tap_size / 2 - sizeof(struct tty0tty_tap_rec);
+	now = ktime_get_ns();
+	for (; len; buf += n, len -= n) {
+		n = min(len, max);
+		tty0tty_tap_put(ring, head, tty0tty->index, now, buf, n);
+	}
 
-	/* port was never opened */
-	if (!tty0tty->open_count)
-		goto exit;
+	if (wq_has_sleeper(&tap->wait))
+		wake_up_interruptible(&tap->wait);
+out:
+	rcu_read_unlock();
+}
 
-	--tty0tty->open_count;
-exit:
-	up(&tty0tty->sem);
+/* ring i carries what tnt(2n + i) sends to tnt(2n + (i ^ 1)) */
+static struct tty0tty_ring *tty0tty_ring(struct tty0tty_serial *tty0tty)
+{
+	return tty0tty->pair->ring_area +
+		(tty0tty->index & 1) * sizeof(struct tty0tty_ring);
 }
 
-static void tty0tty_close(struct tty_struct *tty, struct file *file)
+static unsigned char *tty0tty_ring_data(struct tty0tty_serial *tty0tty)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
+	return tty0tty->pair->ring_area + PAGE_SIZE +
+		(tty0tty->index & 1) * ring_size;
+}
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
-	if (tty0tty)
-		do_close(tty0tty);
+/*
+ * Bytes in the ring of tty0tty; head and tail come from memory userspace
+ * can write, a count that makes no sense is taken as an empty ring.
+ */
+static u32 tty0tty_ring_used(struct tty0tty_ring *ring)
+{
+	u64 used = smp_load_acquire(&ring->head) - smp_load_acquire(&ring->tail);
+
+	return used > ring_size ? 0 : used;
+}
+
+/* the ring of tts changed, called with tts->lock held */
+static void tty0tty_ring_notify(struct tty0tty_serial *tts)
+{
+	if (tts->ring_efd)
+		eventfd_signal(tts->ring_efd, 1);
+	wake_up_interruptible(&tts->ring_wait);
+}
+
+/*
+ * Move up to limit bytes of the transmit FIFO into the ring the peer reads
+ * from, with the same flow control as for a tty. A full ring stops the
+ * transmitter until the reader kicks it. Called with xmit_lock and the
+ * peer's lock held.
+ */
+static unsigned int tty0tty_ring_put(struct tty0tty_serial *tty0tty,
+				     unsigned int limit)
+{
+	struct tty0tty_ring *ring = tty0tty_ring(tty0tty);
+	unsigned char *data = tty0tty_ring_data(tty0tty);
+	u64 head = ring->head;
+	unsigned int pos = head & (ring_size - 1);
+	unsigned int first;
+	unsigned int n;
+
+	tty0tty->tx_stopped = READ_ONCE(tty0tty->xoff) ||
+		tty0tty_cts_held(tty0tty);
+	if (tty0tty->tx_stopped)
+		return 0;
+
+	n = min3(kfifo_len(&tty0tty->xmit), limit,
+		 ring_size - tty0tty_ring_used(ring));
+	first = min(n, ring_size - pos);
+	n = kfifo_out(&tty0tty->xmit, data + pos, first) +
+		kfifo_out(&tty0tty->xmit, data, n - first);
+	smp_store_release(&ring->head, head + n);
+	tty0tty->tx_sent += n;
+	tty0tty_lat_sent(tty0tty);
+
+	if (!kfifo_is_empty(&tty0tty->xmit) && n < limit)
+		tty0tty->tx_stopped = true;
+	if (n)
+		tty0tty_ring_notify(tty0tty->peer);
+	return n;
+}
+
+/*
+ * Whether the driver reads the ring of tty0tty: its owner writes to the
+ * ring instead of the tty, and the peer reads the tty. Called with
+ * xmit_lock held, which orders it against the last close.
+ */
+static bool tty0tty_ring_pulled(struct tty0tty_serial *tty0tty)
+{
+	return READ_ONCE(tty0tty->ring_attached) &&
+		!READ_ONCE(tty0tty->peer->ring_attached) &&
+		READ_ONCE(tty0tty->active);
+}
+
+/* refill the transmit FIFO from the ring, called with xmit_lock held */
+static unsigned int tty0tty_ring_pull(struct tty0tty_serial *tty0tty)
+{
+	struct tty0tty_ring *ring;
+	unsigned char *data;
+	unsigned int first;
+	unsigned int pos;
+	unsigned int n;
+	u64 tail;
+
+	if (!tty0tty_ring_pulled(tty0tty))
+		return 0;
+
+	ring = tty0tty_ring(tty0tty);
+	data = tty0tty_ring_data(tty0tty);
+	tail = ring->tail;
+	pos = tail & (ring_size - 1);
+	n = min(tty0tty_ring_used(ring), kfifo_avail(&tty0tty->xmit));
+	first = min(n, ring_size - pos);
+	kfifo_in(&tty0tty->xmit, data + pos, first);
+	kfifo_in(&tty0tty->xmit, data, n - first);
+	tty0tty_lat_queued(tty0tty, n);
+	if (static_branch_unlikely(&tty0tty_tap_key)) {
+		tty0tty_tap_record(tty0tty, data + pos, first);
+		tty0tty_tap_record(tty0tty, data, n - first);
+	}
+	smp_store_release(&ring->tail, tail + n);
+	return n;
+}
+
+/* data is left in the ring that the FIFO had no room for */
+static bool tty0tty_ring_pending(struct tty0tty_serial *tty0tty)
+{
+	return tty0tty_ring_pulled(tty0tty) &&
+		tty0tty_ring_used(tty0tty_ring(tty0tty));
+}
+
+/*
+ * The flip buffer of tts took none of the len bytes tty0tty has queued.
+ * tx_work retries them every tick, so they count only on the first try.
+ */
+static void tty0tty_rx_overrun(struct tty0tty_serial *tty0tty,
+			       struct tty0tty_serial *tts, unsigned int len)
+{
+	if (tty0tty->tx_overrun)
+		return;
+	tts->icount.buf_overrun += len;
+	tty0tty->tx_overrun = true;
+}
+
+/*
+ * Move up to limit bytes of the transmit FIFO, as far as the peer's flip
+ * buffer accepts them, and return the port that needs a push, if any.
+ * What the flip buffer has no memory for stays queued for a retry and is
+ * counted once per stall as a buffer overrun of the peer. Nothing moves
+ * while the peer is throttled or, with CRTSCTS, while CTS is down;
+ * tx_stopped then tells the callers to wait for tty0tty_tx_restart, as
+ * does XOFF from the peer. A peer reading the shared ring gets the data
+ * there instead, unless this port writes to the ring itself. Called with
+ * xmit_lock held; the peer's lock keeps it from closing while its flip
+ * buffer is filled. Data for a peer that is not open is lost, as on a
+ * disconnected line.
+ */
+static struct tty_port *tty0tty_tx_drain(struct tty0tty_serial *tty0tty,
+					 unsigned int limit)
+{
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	struct tty_port *port = NULL;
+	unsigned char *chars;
+	unsigned int moved = 0;
+	unsigned int unpushed;
+	unsigned int copied;
+	unsigned int len;
+	bool noisy;
+	int room;
+
+	spin_lock(&tts->lock);
+	if (tts->active && tts->ring_attached &&
+	    !READ_ONCE(tty0tty->ring_attached)) {
+		moved = tty0tty_ring_put(tty0tty, limit);
+		this_cpu_add(tts->stats->rx, moved);
+	} else if (tts->active) {
+		tty0tty->tx_stopped = tts->throttled ||
+			READ_ONCE(tty0tty->xoff) || tty0tty_cts_held(tty0tty);
+		while (!tty0tty->tx_stopped &&
+		       (len = min(kfifo_len(&tty0tty->xmit),
+				  limit - moved)) > 0) {
+			/* good bytes go in bulk up to the next bad one */
+			noisy = static_branch_unlikely(&tty0tty_noise_key) &&
+				(tts->noise.frame || tts->noise.parity);
+			if (noisy && !tts->noise_left) {
+				if (!tty0tty_rx_noise(tty0tty, tts)) {
+					tty0tty_rx_overrun(tty0tty, tts, len);
+					break;
+				}
+				moved++;
+				port = tts->tty->port;
+				continue;
+			}
+			if (noisy)
+				len = min(len, tts->noise_left);
+
+			room = tty_prepare_flip_string(tts->tty->port, &chars,
+						       len);
+			if (room <= 0) {
+				tty0tty_rx_overrun(tty0tty, tts, len);
+				break;
+			}
+			copied = kfifo_out(&tty0tty->xmit, chars, room);
+			tty0tty_rx_xchars(tts, chars, copied);
+			if (noisy)
+				tts->noise_left -= copied;
+			moved += copied;
+			port = tts->tty->port;
+		}
+		if (moved)
+			tty0tty->tx_overrun = false;
+		tty0tty->tx_sent += moved;
+		this_cpu_add(tts->stats->rx, moved);
+	} else {
+		tty0tty_tx_discard(tty0tty);
+	}
+	spin_unlock(&tts->lock);
+
+	this_cpu_add(tty0tty->stats->tx, moved);
+
+	if (!port)
+		return NULL;
+
+	unpushed = tty0tty->tx_unpushed + moved;
+	if (!tty0tty_tx_push_due(tty0tty, moved))
+		return NULL;
+
+	trace_tty0tty_push(tts->index, unpushed);
+	tty0tty_lat_sent(tty0tty);
+	return port;
+}
+
+static enum hrtimer_restart tty0tty_push_timer(struct hrtimer *timer)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(timer, struct tty0tty_serial, push_timer);
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	struct tty_port *port = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	spin_lock(&tts->lock);
+	if (tts->active) {
+		port = tts->tty->port;
+		trace_tty0tty_push(tts->index, tty0tty->tx_unpushed);
+		tty0tty_lat_sent(tty0tty);
+	}
+	spin_unlock(&tts->lock);
+	tty0tty->tx_unpushed = 0;
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (port)
+		tty_flip_buffer_push(port);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Paced transmission drains the FIFO in batches, one per pacing slice,
+ * sized by the line time that elapsed since the previous batch. Slow lines
+ * wait for a whole character instead, so the timer never fires per byte.
+ */
+static u64 tty0tty_tx_interval(struct tty0tty_serial *tty0tty)
+{
+	u64 slice = (u64)pacing_slice_usecs * NSEC_PER_USEC;
+
+	if (tty0tty->line.frame_ns > tty0tty->tx_credit_ns + slice)
+		return tty0tty->line.frame_ns - tty0tty->tx_credit_ns;
+
+	return slice;
+}
+
+/* start paced transmission when idle; called with xmit_lock held */
+static void tty0tty_tx_kick(struct tty0tty_serial *tty0tty)
+{
+	if (tty0tty->tx_active)
+		return;
+
+	tty0tty->tx_active = true;
+	tty0tty->tx_credit_ns = 0;
+	tty0tty->tx_last = ktime_get();
+	hrtimer_start(&tty0tty->tx_timer,
+		      ns_to_ktime(tty0tty_tx_interval(tty0tty)),
+		      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart tty0tty_tx_timer(struct hrtimer *timer)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(timer, struct tty0tty_serial, tx_timer);
+	ktime_t now = hrtimer_cb_get_time(timer);
+	unsigned int limit = UINT_MAX;
+	struct tty_port *port;
+	unsigned long flags;
+	unsigned int pulled;
+	unsigned int len;
+	unsigned int moved;
+	bool pending;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+
+	if (tty0tty->pacing && tty0tty->line.frame_ns) {
+		tty0tty->tx_credit_ns += ktime_to_ns(ktime_sub(now,
+							tty0tty->tx_last));
+		tty0tty->tx_last = now;
+		limit = min_t(u64, div64_u64(tty0tty->tx_credit_ns,
+					     tty0tty->line.frame_ns), UINT_MAX);
+	}
+
+	pulled = tty0tty_ring_pull(tty0tty);
+	len = kfifo_len(&tty0tty->xmit);
+	port = tty0tty_tx_drain(tty0tty, limit);
+	moved = len - kfifo_len(&tty0tty->xmit);
+	pending = (!kfifo_is_empty(&tty0tty->xmit) ||
+		   tty0tty_ring_pending(tty0tty)) && !tty0tty->tx_stopped;
+
+	if (limit != UINT_MAX) {
+		tty0tty->tx_credit_ns -= (u64)moved * tty0tty->line.frame_ns;
+		/* an idle line or a stalled reader does not bank line time */
+		if (!pending || moved < limit)
+			tty0tty->tx_credit_ns = min(tty0tty->tx_credit_ns,
+						    tty0tty->line.frame_ns);
+	}
+
+	if (pending)
+		hrtimer_forward_now(timer,
+				    ns_to_ktime(tty0tty_tx_interval(tty0tty)));
+	else
+		tty0tty->tx_active = false;
+
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (port)
+		tty_flip_buffer_push(port);
+
+	if (moved)
+		tty_wakeup(tty0tty->tty);
+
+	if (pulled)
+		tty0tty_ring_kicked(tty0tty);
+
+	return pending ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+/*
+ * Work out the line settings of tty: the character time counts the start
+ * bit, data bits, optional parity bit and one or two stop bits at the
+ * configured baud rate, which baud_base caps if set.
+ */
+static void tty0tty_line_config(struct tty_struct *tty,
+				struct tty0tty_line *line,
+				unsigned int baud_base)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+	unsigned int cflag = tty->termios.c_cflag;
+#else
+	unsigned int cflag = tty->termios->c_cflag;
+#endif
+	unsigned int bits;
+
+	switch (cflag & CSIZE) {
+	case CS5:
+		bits = 5;
+		break;
+	case CS6:
+		bits = 6;
+		break;
+	case CS7:
+		bits = 7;
+		break;
+	default:
+	case CS8:
+		bits = 8;
+		break;
+	}
+
+	bits += 1;			/* start bit */
+	if (cflag & PARENB)
+		bits += 1;
+	bits += (cflag & CSTOPB) ? 2 : 1;
+
+	memset(line, 0, sizeof(*line));
+	line->baud = tty_get_baud_rate(tty);
+	if (baud_base && line->baud > baud_base)
+		line->baud = baud_base;
+	line->frame_bits = bits;
+	line->frame_ns = line->baud ?
+		div_u64((u64)bits * NSEC_PER_SEC, line->baud) : 0;
+	if (C_CRTSCTS(tty))
+		line->flow |= TTY0TTY_LINE_RTSCTS;
+	if (I_IXON(tty))
+		line->flow |= TTY0TTY_LINE_IXON;
+	if (I_IXOFF(tty))
+		line->flow |= TTY0TTY_LINE_IXOFF;
+	if (I_IXANY(tty))
+		line->flow |= TTY0TTY_LINE_IXANY;
+	line->stop_char = STOP_CHAR(tty);
+	line->start_char = START_CHAR(tty);
+}
+
+static void tty0tty_tx_work(struct work_struct *work)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(to_delayed_work(work), struct tty0tty_serial,
+			     tx_work);
+	struct tty_port *port;
+	unsigned int pulled;
+	unsigned int len;
+	bool drained;
+	bool pending;
+	bool more;
+
+	spin_lock_irq(&tty0tty->xmit_lock);
+	if (tty0tty->pacing) {
+		/* the pacing timer retries, and reads the ring, on its own */
+		tty0tty_tx_kick(tty0tty);
+		spin_unlock_irq(&tty0tty->xmit_lock);
+		return;
+	}
+	pulled = tty0tty_ring_pull(tty0tty);
+	len = kfifo_len(&tty0tty->xmit);
+	port = tty0tty_tx_drain(tty0tty, UINT_MAX);
+	drained = kfifo_len(&tty0tty->xmit) < len;
+	pending = !kfifo_is_empty(&tty0tty->xmit) && !tty0tty->tx_stopped;
+	/* the FIFO is empty again but the ring has more */
+	more = !pending && !tty0tty->tx_stopped &&
+		tty0tty_ring_pending(tty0tty);
+	spin_unlock_irq(&tty0tty->xmit_lock);
+
+	if (port)
+		tty_flip_buffer_push(port);
+
+	/* writers blocked on a full FIFO can go on now */
+	if (drained || !pending)
+		tty_wakeup(tty0tty->tty);
+
+	if (pulled)
+		tty0tty_ring_kicked(tty0tty);
+
+	if (pending || more)
+		schedule_delayed_work(&tty0tty->tx_work, more ? 0 : 1);
+}
+
+/* the peer is ready for more, resume whatever flow control held back */
+static void tty0tty_tx_restart(struct tty0tty_serial *tty0tty)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	if (!kfifo_is_empty(&tty0tty->xmit)) {
+		if (tty0tty->pacing)
+			tty0tty_tx_kick(tty0tty);
+		else
+			schedule_delayed_work(&tty0tty->tx_work, 0);
+	}
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+}
+
+/* take over the termios of tty, returns false if the line is unchanged */
+static bool tty0tty_set_line(struct tty0tty_serial *tty0tty,
+			     struct tty_struct *tty)
+{
+	struct tty0tty_line line;
+	unsigned long flags;
+	bool changed;
+
+	tty0tty_line_config(tty, &line, READ_ONCE(tty0tty->baud_base));
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	spin_lock(&tty0tty->lock);
+	changed = memcmp(&tty0tty->line, &line, sizeof(line));
+	tty0tty->line = line;
+	spin_unlock(&tty0tty->lock);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (!changed)
+		return false;
+
+	/* nothing can send XON any more */
+	if (!(line.flow & TTY0TTY_LINE_IXON))
+		WRITE_ONCE(tty0tty->xoff, false);
+
+	tty0tty_tx_restart(tty0tty);
+	return true;
+}
+
+/*
+ * XON/XOFF go out ahead of the data queued in the FIFO, even while this
+ * port is stopped itself.
+ */
+static void tty0tty_send_xchar(struct tty_struct *tty, char ch)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	struct tty_port *port = NULL;
+	unsigned char c = ch;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	spin_lock(&tts->lock);
+	if (tts->active &&
+	    tty_insert_flip_char(tts->tty->port, c, TTY_NORMAL)) {
+		tty0tty_rx_xchars(tts, &c, 1);
+		this_cpu_inc(tts->stats->rx);
+		this_cpu_inc(tty0tty->stats->tx);
+		port = tts->tty->port;
+	}
+	spin_unlock(&tts->lock);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (port)
+		tty_flip_buffer_push(port);
+}
+
+/* the ldisc saw XOFF, or tcflow(TCOOFF) */
+static void tty0tty_stop(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	WRITE_ONCE(tty0tty->xoff, true);
+}
+
+static void tty0tty_start(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	WRITE_ONCE(tty0tty->xoff, false);
+	tty0tty_tx_restart(tty0tty);
+}
+
+/*
+ * The ldisc of this port is full: the peer stops sending, and like on a
+ * UART XOFF is sent with IXOFF and RTS goes down with CRTSCTS.
+ */
+static void tty0tty_throttle(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned int flow;
+
+	spin_lock_irq(&tty0tty->lock);
+	flow = tty0tty->line.flow;
+	tty0tty->throttled = true;
+	spin_unlock_irq(&tty0tty->lock);
+
+	if (flow & TTY0TTY_LINE_IXOFF)
+		tty0tty_send_xchar(tty, tty0tty->line.stop_char);
+
+	if (flow & TTY0TTY_LINE_RTSCTS)
+		tty0tty_update_mcr(tty0tty, 0, TIOCM_RTS);
+}
+
+static void tty0tty_unthrottle(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *tts = get_counterpart(tty0tty);
+	unsigned int flow;
+
+	spin_lock_irq(&tty0tty->lock);
+	flow = tty0tty->line.flow;
+	tty0tty->throttled = false;
+	spin_unlock_irq(&tty0tty->lock);
+
+	if (flow & TTY0TTY_LINE_IXOFF)
+		tty0tty_send_xchar(tty, tty0tty->line.start_char);
+
+	if (flow & TTY0TTY_LINE_RTSCTS)
+		tty0tty_update_mcr(tty0tty, TIOCM_RTS, 0);
+
+	if (tts)
+		tty0tty_tx_restart(tts);
+}
+
+/*
+ * First open of the port, called by tty_port_open with the port mutex
+ * held. The lines of the peer are raised afterwards through dtr_rts.
+ */
+static int tty0tty_activate(struct tty_port *port, struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(port, struct tty0tty_serial, port);
+	struct tty0tty_serial *tts;
+	int msr = 0;
+	int mcr = 0;
+
+	if (READ_ONCE(tty0tty->pair->dead))
+		return -ENODEV;
+
+	/*
+	 * first time accessing this device, the FIFO is not there yet; it
+	 * goes on the pair's node, or else on the node of this first opener
+	 */
+	if (!kfifo_initialized(&tty0tty->xmit)) {
+		void *buf = kmalloc_node(tty0tty->xmit_size, GFP_KERNEL,
+					 tty0tty->pair->node);
+
+		if (!buf)
+			return -ENOMEM;
+		kfifo_init(&tty0tty->xmit, buf, tty0tty->xmit_size);
+	}
+
+	tty0tty_set_line(tty0tty, tty);
+
+	tts = get_counterpart(tty0tty);
+	if (tts)
+		mcr = READ_ONCE(tts->mcr);
+
+	//null modem connection
+
+	if (mcr & MCR_RTS)
+		msr |= MSR_CTS;
+
+	if (mcr & MCR_DTR) {
+		msr |= MSR_DSR;
+		msr |= MSR_CD;
+	}
+
+	tty0tty_update_msr(tty0tty, msr, MSR_CTS | MSR_DSR | MSR_CD);
+
+	spin_lock_irq(&tty0tty->lock);
+	tty0tty->tty = tty;
+	tty0tty->active = true;
+	spin_unlock_irq(&tty0tty->lock);
+	return 0;
+}
+
+/* last close or hangup, called with the port mutex held */
+static void tty0tty_shutdown(struct tty_port *port)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(port, struct tty0tty_serial, port);
+	struct tty0tty_serial *tts = get_counterpart(tty0tty);
+
+	/* the cable is unplugged, whatever HUPCL says */
+	spin_lock_irq(&tty0tty->lock);
+	tty0tty->mcr = 0;
+	spin_unlock_irq(&tty0tty->lock);
+	if (tts)
+		tty0tty_update_msr(tts, 0, MSR_CTS | MSR_DSR | MSR_CD | MSR_RI);
+
+	spin_lock_irq(&tty0tty->lock);
+	tty0tty->active = false;
+	spin_unlock_irq(&tty0tty->lock);
+	/* a hangup or the last close ends TIOCMIWAIT */
+	wake_up_interruptible(&tty0tty->wait);
+
+	/*
+	 * nobody is left to wait for the data still queued; empty the FIFO
+	 * first so a restart by the peer cannot queue more work
+	 */
+	spin_lock_irq(&tty0tty->xmit_lock);
+	tty0tty_tx_discard(tty0tty);
+	spin_unlock_irq(&tty0tty->xmit_lock);
+	cancel_delayed_work_sync(&tty0tty->tx_work);
+	hrtimer_cancel(&tty0tty->tx_timer);
+	hrtimer_cancel(&tty0tty->push_timer);
+	spin_lock_irq(&tty0tty->xmit_lock);
+	tty0tty->tx_unpushed = 0;
+	tty0tty->tx_active = false;
+	spin_unlock_irq(&tty0tty->xmit_lock);
+	WRITE_ONCE(tty0tty->throttled, false);
+
+	/* whatever the peer held back for us is now thrown away */
+	if (tts)
+		tty0tty_tx_restart(tts);
+}
+
+static int tty0tty_open(struct tty_struct *tty, struct file *file)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	int retval;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	retval = tty_port_open(&tty0tty->port, tty, file);
+	trace_tty0tty_open(tty0tty->index, READ_ONCE(tty0tty->port.count));
+	return retval;
+}
+
+static void tty0tty_close(struct tty_struct *tty, struct file *file)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	tty_port_close(&tty0tty->port, tty, file);
+	trace_tty0tty_close(tty0tty->index, READ_ONCE(tty0tty->port.count));
+}
+
+static void tty0tty_hangup(struct tty_struct *tty)
+{
+	tty_port_hangup(tty->port);
+}
+
+/*
+ * Copy a write straight from the caller's buffer into the flip buffer of
+ * every other open member of the bus, one insert and push per member.
+ * Like on a real bus there is no flow control: a member whose buffer is
+ * full loses the rest, counted as its buffer overrun.
+ */
+static int tty0tty_bus_write(struct tty0tty_serial *tty0tty,
+			     struct tty0tty_bus *bus,
+			     const unsigned char *buf, int count)
+{
+	struct tty0tty_serial *tts;
+	struct tty_port *port;
+	unsigned long flags;
+	int done;
+
+	trace_tty0tty_write(tty0tty->index, count, count);
+	if (static_branch_unlikely(&tty0tty_tap_key)) {
+		local_irq_save(flags);
+		tty0tty_tap_record(tty0tty, buf, count);
+		local_irq_restore(flags);
+	}
+
+	list_for_each_entry_rcu(tts, &bus->members, bus_node) {
+		if (tts == tty0tty)
+			continue;
+
+		port = NULL;
+		spin_lock_irqsave(&tts->lock, flags);
+		if (tts->active) {
+			port = tts->tty->port;
+			done = tty_insert_flip_string(port, buf, count);
+			tts->icount.buf_overrun += count - done;
+			this_cpu_add(tts->stats->rx, done);
+		}
+		spin_unlock_irqrestore(&tts->lock, flags);
+
+		if (port)
+			tty_flip_buffer_push(port);
+	}
+	this_cpu_add(tty0tty->stats->tx, count);
+
+	return count;
+}
+
+/*
+ * Start moving what was just queued: the pacing timer takes over, or the
+ * FIFO is drained right away. Returns the port to push; pending is set if
+ * part of it waits for tx_work. Called with xmit_lock held.
+ */
+static struct tty_port *tty0tty_tx_send(struct tty0tty_serial *tty0tty,
+					bool *pending)
+{
+	struct tty_port *port;
+
+	if (tty0tty->pacing) {
+		tty0tty_tx_kick(tty0tty);
+		*pending = false;
+		return NULL;
+	}
+	port = tty0tty_tx_drain(tty0tty, UINT_MAX);
+	*pending = !kfifo_is_empty(&tty0tty->xmit) && !tty0tty->tx_stopped;
+	return port;
+}
+
+/* tty_ldisc_receive_buf is exported since 4.12 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+/*
+ * Nothing of tts is waiting in its flip buffer, neither committed nor
+ * still being filled. Looks at the buffer list as flush_to_ldisc does;
+ * the caller keeps the producers out with tts->lock and flush_to_ldisc
+ * with tty_buffer_lock_exclusive.
+ */
+static bool tty0tty_flip_empty(struct tty0tty_serial *tts)
+{
+	struct tty_buffer *head = tts->port.buf.head;
+
+	return !head->next && head->read == head->used;
+}
+
+/*
+ * Low latency: hand a small write to the line discipline of the peer in
+ * the writer's context, instead of the FIFO and the flip buffer worker.
+ * That is only safe between two N_TTY ends, from process context, and
+ * while nothing that would have to arrive first is on its way: the FIFO
+ * and the peer's flip buffer are empty and the line is not held. One
+ * delivery per pair at a time, so an echo of the peer goes the usual way
+ * instead of back into this ldisc. Returns the bytes the ldisc took; the
+ * caller queues the rest as usual.
+ */
+static int tty0tty_write_direct(struct tty0tty_serial *tty0tty,
+				struct tty_struct *tty,
+				const unsigned char *buf, int count)
+{
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	struct tty0tty_pair *pair = tty0tty->pair;
+	struct tty_struct *peer;
+	struct tty_ldisc *ld;
+	unsigned long flags;
+	bool clear;
+	u64 start = 0;
+	int done = 0;
+
+	if (count > TTY0TTY_DIRECT_MAX || !in_task() ||
+	    tty->ldisc->ops->num != N_TTY)
+		return 0;
+	if (test_and_set_bit_lock(0, &pair->direct))
+		return 0;
+
+	peer = tty_port_tty_get(&tts->port);
+	if (!peer)
+		goto out;
+	ld = tty_ldisc_ref(peer);
+	if (!ld)
+		goto out_put;
+	if (ld->ops->num != N_TTY)
+		goto out_deref;
+
+	tty_buffer_lock_exclusive(&tts->port);
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	spin_lock(&tts->lock);
+	clear = tts->active && !tts->throttled && !tts->ring_attached &&
+		!READ_ONCE(tty0tty->xoff) && !tty0tty_cts_held(tty0tty) &&
+		!tty0tty->pacing && kfifo_is_empty(&tty0tty->xmit) &&
+		!tts->noise.frame && !tts->noise.parity &&
+		tty0tty_flip_empty(tts);
+	spin_unlock(&tts->lock);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (clear) {
+		start = ktime_get_ns();
+		done = tty_ldisc_receive_buf(ld, buf, NULL, count);
+	}
+	tty_buffer_unlock_exclusive(&tts->port);
+	if (done <= 0) {
+		done = 0;
+		goto out_deref;
+	}
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	spin_lock(&tts->lock);
+	/* the peer may have shut down while its ldisc had the data */
+	if (tts->active) {
+		tty0tty_rx_xchars(tts, buf, done);
+		this_cpu_add(tts->stats->rx, done);
+	}
+	spin_unlock(&tts->lock);
+
+	trace_tty0tty_write(tty0tty->index, done, 0);
+	trace_tty0tty_push(tts->index, done);
+	tty0tty->tx_queued += done;
+	tty0tty->tx_sent += done;
+	if (static_branch_unlikely(&tty0tty_lat_key))
+		tty0tty->lat_hist[min(fls64(ktime_get_ns() - start),
+				      TTY0TTY_LAT_BUCKETS - 1)]++;
+	if (static_branch_unlikely(&tty0tty_tap_key))
+		tty0tty_tap_record(tty0tty, buf, done);
+	this_cpu_add(tty0tty->stats->tx, done);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+out_deref:
+	tty_ldisc_deref(ld);
+out_put:
+	tty_kref_put(peer);
+out:
+	clear_bit_unlock(0, &pair->direct);
+	return done;
+}
+#else
+static int tty0tty_write_direct(struct tty0tty_serial *tty0tty,
+				struct tty_struct *tty,
+				const unsigned char *buf, int count)
+{
+	return 0;
+}
+#endif
+
+/*
+ * The write path never sleeps outside of a low latency direct delivery:
+ * data goes into this port's FIFO and is drained into the peer under
+ * spinlocks only, so a writer sees the real free space and blocks in the
+ * line discipline instead of losing data.
+ */
+static int tty0tty_write(struct tty_struct *tty, const unsigned char *buffer,
+			 int count)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty_port *port;
+	unsigned long flags;
+	bool pending;
+	int direct = 0;
+	int queued;
+
+	if (!tty0tty)
+		return -ENODEV;
+
+	/* port was not opened */
+	if (!READ_ONCE(tty0tty->active))
+		return -EINVAL;
+
+	if (static_branch_unlikely(&tty0tty_bus_key)) {
+		struct tty0tty_bus *bus;
+
+		rcu_read_lock();
+		bus = rcu_dereference(tty0tty->bus);
+		if (bus)
+			count = tty0tty_bus_write(tty0tty, bus, buffer, count);
+		rcu_read_unlock();
+		if (bus)
+			return count;
+	}
+
+	/* nobody on the other end */
+	if (!get_counterpart(tty0tty)) {
+		trace_tty0tty_drop(tty0tty->index, count);
+		this_cpu_add(tty0tty->stats->dropped, count);
+		return -EINVAL;
+	}
+
+	if (READ_ONCE(tty0tty->low_latency)) {
+		direct = tty0tty_write_direct(tty0tty, tty, buffer, count);
+		if (direct == count)
+			return count;
+		buffer += direct;
+		count -= direct;
+	}
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	queued = kfifo_in(&tty0tty->xmit, buffer, count);
+	trace_tty0tty_write(tty0tty->index, count, queued);
+	count = queued;
+	tty0tty_lat_queued(tty0tty, count);
+	if (static_branch_unlikely(&tty0tty_tap_key))
+		tty0tty_tap_record(tty0tty, buffer, count);
+	port = tty0tty_tx_send(tty0tty, &pending);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (port)
+		tty_flip_buffer_push(port);
+
+	if (pending)
+		schedule_delayed_work(&tty0tty->tx_work, 1);
+
+	return direct + count;
+}
+
+static int tty0tty_write_room(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	if (!tty0tty)
+		return -ENODEV;
+
+	/* port was not opened */
+	if (!READ_ONCE(tty0tty->active))
+		return -EINVAL;
+
+	/* calculate how much room is left in the device */
+	return kfifo_avail(&tty0tty->xmit);
+}
+
+static int tty0tty_chars_in_buffer(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	if (!tty0tty)
+		return 0;
+
+	return kfifo_len(&tty0tty->xmit);
+}
+
+static void tty0tty_flush_buffer(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned long flags;
+
+	if (!tty0tty)
+		return;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	kfifo_reset_out(&tty0tty->xmit);
+	tty0tty_lat_discard(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	tty_wakeup(tty);
+}
+
+static void tty0tty_set_termios(struct tty_struct *tty,
+				struct ktermios *old_termios)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	if (!tty0tty_set_line(tty0tty, tty))
+		return;
+
+	dev_dbg(tty->dev, "%s - %u baud, %u bits per character, flow %#x\n",
+		__func__, tty0tty->line.baud, tty0tty->line.frame_bits,
+		tty0tty->line.flow);
+}
+
+static int tty0tty_tiocmget(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	unsigned int result = 0;
+	unsigned int msr = tty0tty->msr;
+	unsigned int mcr = tty0tty->mcr;
+
+	result = ((mcr & MCR_DTR) ? TIOCM_DTR : 0) |	/* DTR is set */
+	    ((mcr & MCR_RTS) ? TIOCM_RTS : 0) |	/* RTS is set */
+	    ((mcr & MCR_LOOP) ? TIOCM_LOOP : 0) |	/* LOOP is set */
+	    ((msr & MSR_CTS) ? TIOCM_CTS : 0) |	/* CTS is set */
+	    ((msr & MSR_CD) ? TIOCM_CAR : 0) |	/* Carrier detect is set */
+	    ((msr & MSR_RI) ? TIOCM_RI : 0) |	/* Ring Indicator is set */
+	    ((msr & MSR_DSR) ? TIOCM_DSR : 0);	/* DSR is set */
+
+	return result;
+}
+
+static int tty0tty_tiocmset(struct tty_struct *tty,
+			    unsigned int set, unsigned int clear)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	tty0tty_update_mcr(tty0tty, set, clear);
+	return 0;
+}
+
+/* raised by tty_port_open unless at B0, lowered on close with HUPCL */
+static void tty0tty_dtr_rts(struct tty_port *port, int raise)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(port, struct tty0tty_serial, port);
+	unsigned int lines = TIOCM_DTR | TIOCM_RTS;
+
+	if (raise)
+		tty0tty_update_mcr(tty0tty, lines, 0);
+	else
+		tty0tty_update_mcr(tty0tty, 0, lines);
+}
+
+/* one break character to tts, unless it is closed or reads the ring */
+static struct tty_port *tty0tty_rx_break(struct tty0tty_serial *tts)
+{
+	struct tty_port *port = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tts->lock, flags);
+	if (tts->active && !tts->ring_attached &&
+	    tty_insert_flip_char(tts->tty->port, 0, TTY_BREAK)) {
+		port = tts->tty->port;
+		tts->icount.brk++;
+	}
+	spin_unlock_irqrestore(&tts->lock, flags);
+
+	return port;
+}
+
+/*
+ * A break on the line reaches the receiver as a single TTY_BREAK when it
+ * starts, like a UART reporting the break condition; on a bus all other
+ * members see it. The tty core drains the FIFO before TCSBRK gets here.
+ */
+static int tty0tty_break_ctl(struct tty_struct *tty, int state)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *tts;
+	struct tty0tty_bus *bus = NULL;
+	struct tty_port *port;
+
+	dev_dbg(tty->dev, "%s - %d\n", __func__, state);
+
+	if (!state)
+		return 0;
+
+	rcu_read_lock();
+	if (static_branch_unlikely(&tty0tty_bus_key))
+		bus = rcu_dereference(tty0tty->bus);
+	if (bus) {
+		list_for_each_entry_rcu(tts, &bus->members, bus_node) {
+			if (tts == tty0tty)
+				continue;
+			port = tty0tty_rx_break(tts);
+			if (port)
+				tty_flip_buffer_push(port);
+		}
+	}
+	rcu_read_unlock();
+
+	if (!bus) {
+		port = tty0tty_rx_break(get_peer(tty0tty));
+		if (port)
+			tty_flip_buffer_push(port);
+	}
+	return 0;
+}
+
+static void tty0tty_get_config(struct tty0tty_serial *tty0tty,
+			       struct tty0tty_config *cfg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	cfg->flags = tty0tty->pacing ? TTY0TTY_PACING : 0;
+	if (tty0tty->low_latency)
+		cfg->flags |= TTY0TTY_LOW_LATENCY;
+	cfg->fifo_size = tty0tty->xmit_size;
+	cfg->coalesce_bytes = tty0tty->coalesce_bytes;
+	cfg->coalesce_usecs = tty0tty->coalesce_usecs;
+	cfg->baud_base = tty0tty->baud_base;
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+}
+
+/*
+ * Retune a port, the one place TTY0TTY_IOCSFLAGS, TTY0TTY_IOCSCONFIG and
+ * TIOCSSERIAL end up. A new FIFO size replaces the FIFO, which only works
+ * while it is empty; that and baud_base are for the administrator.
+ */
+static int tty0tty_set_config(struct tty_struct *tty,
+			      const struct tty0tty_config *cfg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_config old;
+	unsigned int size;
+	unsigned long flags;
+	void *buf = NULL;
+
+	if (cfg->flags & ~TTY0TTY_FLAGS_MASK ||
+	    cfg->fifo_size < 256 || cfg->fifo_size > 1 << 20 ||
+	    !cfg->coalesce_usecs || cfg->coalesce_usecs > USEC_PER_SEC)
+		return -EINVAL;
+	size = roundup_pow_of_two(cfg->fifo_size);
+
+	tty0tty_get_config(tty0tty, &old);
+	if ((size != old.fifo_size || cfg->baud_base != old.baud_base) &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (size != old.fifo_size) {
+		buf = kmalloc_node(size, GFP_KERNEL, tty0tty->pair->node);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	if (buf) {
+		if (!kfifo_is_empty(&tty0tty->xmit)) {
+			spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+			kfree(buf);
+			return -EBUSY;
+		}
+		kfifo_free(&tty0tty->xmit);
+		kfifo_init(&tty0tty->xmit, buf, size);
+		tty0tty->xmit_size = size;
+	}
+	tty0tty->pacing = !!(cfg->flags & TTY0TTY_PACING);
+	tty0tty->low_latency = !!(cfg->flags & TTY0TTY_LOW_LATENCY);
+	tty0tty->coalesce_bytes = cfg->coalesce_bytes;
+	tty0tty->coalesce_usecs = cfg->coalesce_usecs;
+	WRITE_ONCE(tty0tty->baud_base, cfg->baud_base);
+	/*
+	 * when pacing is switched off a running timer drains the rest at
+	 * once and stops
+	 */
+	if (!kfifo_is_empty(&tty0tty->xmit) && tty0tty->pacing)
+		tty0tty_tx_kick(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (cfg->baud_base != old.baud_base)
+		tty0tty_set_line(tty0tty, tty);
+	return 0;
+}
+
+static int tty0tty_get_serial(struct tty_struct *tty,
+			      struct serial_struct *ss)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct serial_struct *info;
+	struct tty0tty_config cfg;
+
+	info = &tty0tty->pair->serial_info[tty0tty->index % 2];
+	tty0tty_get_config(tty0tty, &cfg);
+
+	memset(ss, 0, sizeof(*ss));
+	ss->type = info->type;
+	ss->line = tty0tty->index;
+	ss->port = info->port;
+	ss->irq = info->irq;
+	ss->flags = ASYNC_SKIP_TEST | ASYNC_AUTO_IRQ;
+	if (cfg.flags & TTY0TTY_LOW_LATENCY)
+		ss->flags |= ASYNC_LOW_LATENCY;
+	ss->xmit_fifo_size = cfg.fifo_size;
+	ss->baud_base = cfg.baud_base;
+	ss->close_delay = 5 * HZ;
+	ss->closing_wait = 30 * HZ;
+	ss->custom_divisor = info->custom_divisor;
+	ss->hub6 = info->hub6;
+	ss->io_type = info->io_type;
+	return 0;
+}
+
+/* setserial: low_latency, xmit_fifo_size and baud_base, the rest stays */
+static int tty0tty_set_serial(struct tty_struct *tty,
+			      struct serial_struct *ss)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_config cfg;
+
+	tty0tty_get_config(tty0tty, &cfg);
+	cfg.flags &= ~TTY0TTY_LOW_LATENCY;
+	if (ss->flags & ASYNC_LOW_LATENCY)
+		cfg.flags |= TTY0TTY_LOW_LATENCY;
+	if (ss->xmit_fifo_size)
+		cfg.fifo_size = ss->xmit_fifo_size;
+	cfg.baud_base = ss->baud_base;
+	return tty0tty_set_config(tty, &cfg);
+}
+
+/* before 4.20 TIOCGSERIAL and TIOCSSERIAL reach the driver's ioctl */
+static int tty0tty_ioctl_tiocgserial(struct tty_struct *tty,
+				     unsigned int cmd, unsigned long arg)
+{
+	struct serial_struct tmp;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+	if (cmd == TIOCGSERIAL) {
+		if (!arg)
+			return -EFAULT;
+
+		tty0tty_get_serial(tty, &tmp);
+		if (copy_to_user
+		    ((void __user *)arg, &tmp, sizeof(struct serial_struct)))
+			return -EFAULT;
+		return 0;
+	}
+	if (cmd == TIOCSSERIAL) {
+		if (copy_from_user(&tmp, (void __user *)arg, sizeof(tmp)))
+			return -EFAULT;
+		return tty0tty_set_serial(tty, &tmp);
+	}
+	return -ENOIOCTLCMD;
+}
+
+static void tty0tty_get_icount(struct tty0tty_serial *tty0tty,
+			       struct async_icount *icount)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	*icount = tty0tty->icount;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+}
+
+/* snapshot icount and tell whether a modem line moved since prev */
+static bool tty0tty_msr_changed(struct tty0tty_serial *tty0tty,
+				struct async_icount *prev,
+				struct async_icount *now)
+{
+	tty0tty_get_icount(tty0tty, now);
+
+	return now->rng != prev->rng || now->dsr != prev->dsr ||
+	       now->dcd != prev->dcd || now->cts != prev->cts;
+}
+
+static int tty0tty_ioctl_tiocmiwait(struct tty_struct *tty,
+				    unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	if (cmd == TIOCMIWAIT) {
+		struct async_icount cnow;
+		struct async_icount cprev;
+
+		tty0tty_get_icount(tty0tty, &cprev);
+		while (1) {
+			if (wait_event_interruptible(tty0tty->wait,
+					!READ_ONCE(tty0tty->active) ||
+					tty0tty_msr_changed(tty0tty, &cprev,
+							    &cnow)))
+				return -ERESTARTSYS;
+
+			/* the port was hung up or closed under us */
+			if (!READ_ONCE(tty0tty->active))
+				return -EIO;
+
+			if (((arg & TIOCM_RNG) && (cnow.rng != cprev.rng)) ||
+			    ((arg & TIOCM_DSR) && (cnow.dsr != cprev.dsr)) ||
+			    ((arg & TIOCM_CD) && (cnow.dcd != cprev.dcd)) ||
+			    ((arg & TIOCM_CTS) && (cnow.cts != cprev.cts))) {
+				return 0;
+			}
+			cprev = cnow;
+		}
+	}
+	return -ENOIOCTLCMD;
+}
+
+static int tty0tty_ioctl_tiocgicount(struct tty_struct *tty,
+				     unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	if (cmd == TIOCGICOUNT) {
+		struct async_icount cnow;
+		struct tty0tty_stats stats;
+		struct serial_icounter_struct icount;
+
+		tty0tty_get_icount(tty0tty, &cnow);
+		tty0tty_get_stats(tty0tty, &stats);
+		cnow.rx = stats.rx;
+		cnow.tx = stats.tx;
+
+		icount.cts = cnow.cts;
+		icount.dsr = cnow.dsr;
+		icount.rng = cnow.rng;
+		icount.dcd = cnow.dcd;
+		icount.rx = cnow.rx;
+		icount.tx = cnow.tx;
+		icount.frame = cnow.frame;
+		icount.overrun = cnow.overrun;
+		icount.parity = cnow.parity;
+		icount.brk = cnow.brk;
+		icount.buf_overrun = cnow.buf_overrun;
+
+		if (copy_to_user((void __user *)arg, &icount, sizeof(icount)))
+			return -EFAULT;
+		return 0;
+	}
+	return -ENOIOCTLCMD;
+}
+
+static int tty0tty_ioctl_flags(struct tty_struct *tty,
+			       unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_config cfg;
+	__u32 mode;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	tty0tty_get_config(tty0tty, &cfg);
+
+	if (cmd == TTY0TTY_IOCGFLAGS) {
+		if (copy_to_user((void __user *)arg, &cfg.flags,
+				 sizeof(cfg.flags)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (cmd == TTY0TTY_IOCSFLAGS) {
+		if (copy_from_user(&mode, (void __user *)arg, sizeof(mode)))
+			return -EFAULT;
+		cfg.flags = mode;
+		return tty0tty_set_config(tty, &cfg);
+	}
+
+	if (cmd == TTY0TTY_IOCGCONFIG) {
+		if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (cmd == TTY0TTY_IOCSCONFIG) {
+		if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		return tty0tty_set_config(tty, &cfg);
+	}
+	return -ENOIOCTLCMD;
+}
+
+/*
+ * TTY0TTY_IOCSNOISE sets the line errors this port receives. The static
+ * key counts the ports with errors on, so it is switched with the mutex.
+ */
+static int tty0tty_ioctl_noise(struct tty_struct *tty,
+			       unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_noise noise;
+	unsigned long flags;
+	bool was, now;
+
+	dev_dbg(tty->dev, "%s -\n", __func__);
+
+	if (cmd == TTY0TTY_IOCGNOISE) {
+		spin_lock_irqsave(&tty0tty->lock, flags);
+		noise = tty0tty->noise;
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+		if (copy_to_user((void __user *)arg, &noise, sizeof(noise)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (cmd == TTY0TTY_IOCSNOISE) {
+		if (copy_from_user(&noise, (void __user *)arg, sizeof(noise)))
+			return -EFAULT;
+		if (noise.frame > TTY0TTY_NOISE_MAX ||
+		    noise.parity > TTY0TTY_NOISE_MAX - noise.frame)
+			return -EINVAL;
+
+		mutex_lock(&tty0tty_pairs_lock);
+		spin_lock_irqsave(&tty0tty->lock, flags);
+		was = tty0tty->noise.frame || tty0tty->noise.parity;
+		tty0tty->noise = noise;
+		tty0tty_noise_next(tty0tty);
+		now = noise.frame || noise.parity;
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+		if (now && !was)
+			static_branch_inc(&tty0tty_noise_key);
+		else if (was && !now)
+			static_branch_dec(&tty0tty_noise_key);
+		mutex_unlock(&tty0tty_pairs_lock);
+		return 0;
+	}
+	return -ENOIOCTLCMD;
+}
+
+/*
+ * The driver read part of the ring of tty0tty, or its owner changed the
+ * rings: tell whoever waits on the other side of them.
+ */
+static void tty0tty_ring_kicked(struct tty0tty_serial *tty0tty)
+{
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty_ring_notify(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	/* a peer stopped on a full ring may go on */
+	tty0tty_tx_restart(tts);
+}
+
+/*
+ * TTY0TTY_IOCKICK: the owner wrote to its ring or read from the peer's.
+ * A peer on the ring is woken, otherwise the driver carries the data to
+ * the peer's tty and refills the ring from it.
+ */
+static void tty0tty_ring_kick(struct tty0tty_serial *tty0tty)
+{
+	struct tty0tty_serial *tts = get_peer(tty0tty);
+	struct tty_port *port = NULL;
+	unsigned int pulled = 0;
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&tts->lock, flags);
+	if (tts->ring_attached)
+		tty0tty_ring_notify(tts);
+	spin_unlock_irqrestore(&tts->lock, flags);
+
+	spin_lock_irqsave(&tty0tty->xmit_lock, flags);
+	if (tty0tty_ring_pulled(tty0tty)) {
+		pulled = tty0tty_ring_pull(tty0tty);
+		port = tty0tty_tx_send(tty0tty, &pending);
+		if (!pending && tty0tty_ring_pending(tty0tty))
+			schedule_delayed_work(&tty0tty->tx_work, 0);
+		else if (pending)
+			schedule_delayed_work(&tty0tty->tx_work, 1);
+	}
+	spin_unlock_irqrestore(&tty0tty->xmit_lock, flags);
+
+	if (port)
+		tty_flip_buffer_push(port);
+
+	if (pulled)
+		tty0tty_ring_kicked(tty0tty);
+	else
+		tty0tty_tx_restart(tts);
+}
+
+static void tty0tty_pair_release(struct kref *kref);
+
+/* switch tty0tty back to its tty and drop what TTY0TTY_IOCRING took */
+static void tty0tty_ring_detach(struct tty0tty_serial *tty0tty)
+{
+	struct eventfd_ctx *efd;
+
+	spin_lock_irq(&tty0tty->lock);
+	efd = tty0tty->ring_efd;
+	tty0tty->ring_efd = NULL;
+	tty0tty->ring_attached = false;
+	spin_unlock_irq(&tty0tty->lock);
+
+	if (efd)
+		eventfd_ctx_put(efd);
+
+	/* the peer writes to the tty again */
+	tty0tty_tx_restart(get_peer(tty0tty));
+
+	kref_put(&tty0tty->pair->kref, tty0tty_pair_release);
+}
+
+static int tty0tty_ring_release(struct inode *inode, struct file *file)
+{
+	tty0tty_ring_detach(file->private_data);
+	return 0;
+}
+
+static long tty0tty_ring_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	switch (cmd) {
+	case TTY0TTY_IOCKICK:
+		tty0tty_ring_kick(file->private_data);
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+static int tty0tty_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tty0tty_serial *tty0tty = file->private_data;
+
+	return remap_vmalloc_range(vma, tty0tty->pair->ring_area,
+				   vma->vm_pgoff);
+}
+
+/* readable with data from the peer, writable with room for the peer */
+static __poll_t tty0tty_ring_poll(struct file *file, poll_table *wait)
+{
+	struct tty0tty_serial *tty0tty = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &tty0tty->ring_wait, wait);
+	if (tty0tty_ring_used(tty0tty_ring(get_peer(tty0tty))))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (tty0tty_ring_used(tty0tty_ring(tty0tty)) < ring_size)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+static const struct file_operations tty0tty_ring_fops = {
+	.owner = THIS_MODULE,
+	.release = tty0tty_ring_release,
+	.unlocked_ioctl = tty0tty_ring_ioctl,
+	.compat_ioctl = tty0tty_ring_ioctl,
+	.mmap = tty0tty_ring_mmap,
+	.poll = tty0tty_ring_poll,
+	.llseek = noop_llseek,
+};
+
+static void *tty0tty_ring_alloc(void)
+{
+	struct tty0tty_ring *ring;
+	void *area;
+	int i;
+
+	area = vmalloc_user(PAGE_SIZE + 2 * ring_size);
+	if (!area)
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		ring = area + i * sizeof(*ring);
+		ring->size = ring_size;
+		ring->data_offset = PAGE_SIZE + i * ring_size;
+	}
+	return area;
+}
+
+/*
+ * TTY0TTY_IOCRING: return a file that maps the shared ring of the pair
+ * and switches this port to it, until the file is released. The argument
+ * is an eventfd to signal when the rings changed, or -1.
+ */
+static int tty0tty_ioctl_ring(struct tty_struct *tty,
+			      unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_pair *pair = tty0tty->pair;
+	struct eventfd_ctx *efd = NULL;
+	int retval = 0;
+	int fd;
+
+	if (get_user(fd, (int __user *)arg))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		efd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	mutex_lock(&tty0tty_pairs_lock);
+	if (!pair->ring_area)
+		pair->ring_area = tty0tty_ring_alloc();
+	if (!pair->ring_area)
+		retval = -ENOMEM;
+	else if (tty0tty->ring_attached)
+		retval = -EBUSY;
+	if (!retval) {
+		kref_get(&pair->kref);
+		spin_lock_irq(&tty0tty->lock);
+		tty0tty->ring_efd = efd;
+		tty0tty->ring_attached = true;
+		spin_unlock_irq(&tty0tty->lock);
+	}
+	mutex_unlock(&tty0tty_pairs_lock);
+
+	if (retval) {
+		if (efd)
+			eventfd_ctx_put(efd);
+		return retval;
+	}
+
+	retval = anon_inode_getfd("[tty0tty_ring]", &tty0tty_ring_fops,
+				  tty0tty, O_RDWR | O_CLOEXEC);
+	if (retval < 0)
+		tty0tty_ring_detach(tty0tty);
+	return retval;
+}
+
+static int tty0tty_ioctl(struct tty_struct *tty,
+			 unsigned int cmd, unsigned long arg)
+{
+	dev_dbg(tty->dev, "%s - %04X\n", __func__, cmd);
+
+	switch (cmd) {
+	case TIOCGSERIAL:
+	case TIOCSSERIAL:
+		return tty0tty_ioctl_tiocgserial(tty, cmd, arg);
+	case TIOCMIWAIT:
+		return tty0tty_ioctl_tiocmiwait(tty, cmd, arg);
+	case TIOCGICOUNT:
+		return tty0tty_ioctl_tiocgicount(tty, cmd, arg);
+	case TTY0TTY_IOCGFLAGS:
+	case TTY0TTY_IOCSFLAGS:
+	case TTY0TTY_IOCGCONFIG:
+	case TTY0TTY_IOCSCONFIG:
+		return tty0tty_ioctl_flags(tty, cmd, arg);
+	case TTY0TTY_IOCRING:
+		return tty0tty_ioctl_ring(tty, cmd, arg);
+	case TTY0TTY_IOCGNOISE:
+	case TTY0TTY_IOCSNOISE:
+		return tty0tty_ioctl_noise(tty, cmd, arg);
+	}
+
+	return -ENOIOCTLCMD;
+}
+
+static void tty0tty_pair_release(struct kref *kref)
+{
+	struct tty0tty_pair *pair = container_of(kref, struct tty0tty_pair,
+						 kref);
+	int i;
+
+	/* the number of a destroyed pair is only free once its ttys are gone */
+	mutex_lock(&tty0tty_pairs_lock);
+	if (tty0tty_pairs[pair->index] == pair)
+		tty0tty_pairs[pair->index] = NULL;
+	mutex_unlock(&tty0tty_pairs_lock);
+
+	for (i = 0; i < 2; i++) {
+		kfifo_free(&pair->serial[i].xmit);
+		free_percpu(pair->serial[i].stats);
+		if (pair->serial[i].noise.frame || pair->serial[i].noise.parity)
+			static_branch_dec(&tty0tty_noise_key);
+	}
+	vfree(pair->ring_area);
+	kmem_cache_free(tty0tty_pair_cache, pair);
+}
+
+/* the last reference of one end is gone, the pair goes with the second */
+static void tty0tty_port_destruct(struct tty_port *port)
+{
+	struct tty0tty_serial *tty0tty =
+		container_of(port, struct tty0tty_serial, port);
+
+	kref_put(&tty0tty->pair->kref, tty0tty_pair_release);
+}
+
+static const struct tty_port_operations tty0tty_port_ops = {
+	.dtr_rts = tty0tty_dtr_rts,
+	.activate = tty0tty_activate,
+	.shutdown = tty0tty_shutdown,
+	.destruct = tty0tty_port_destruct,
+};
+
+/*
+ * Pairs come and go at runtime, so the port is looked up and pinned here
+ * instead of being linked to the driver once at load.
+ */
+static int tty0tty_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+	struct tty0tty_pair *pair;
+	struct tty_port *port = NULL;
+	int retval;
+
+	mutex_lock(&tty0tty_pairs_lock);
+	pair = tty0tty_pair_lookup(tty->index / 2);
+	if (pair)
+		port = tty_port_get(&pair->serial[tty->index % 2].port);
+	mutex_unlock(&tty0tty_pairs_lock);
+
+	if (!port)
+		return -ENODEV;
+
+	retval = tty_port_install(port, driver, tty);
+	if (retval) {
+		tty_port_put(port);
+		return retval;
+	}
+	tty->driver_data = container_of(port, struct tty0tty_serial, port);
+	return 0;
+}
+
+static void tty0tty_cleanup(struct tty_struct *tty)
+{
+	tty_port_put(tty->port);
+}
+
+static const struct tty_operations serial_ops = {
+	.install = tty0tty_install,
+	.cleanup = tty0tty_cleanup,
+	.throttle = tty0tty_throttle,
+	.unthrottle = tty0tty_unthrottle,
+	.send_xchar = tty0tty_send_xchar,
+	.stop = tty0tty_stop,
+	.start = tty0tty_start,
+	.open = tty0tty_open,
+	.close = tty0tty_close,
+	.hangup = tty0tty_hangup,
+	.write = tty0tty_write,
+	.write_room = tty0tty_write_room,
+	.chars_in_buffer = tty0tty_chars_in_buffer,
+	.flush_buffer = tty0tty_flush_buffer,
+	.set_termios = tty0tty_set_termios,
+	.tiocmget = tty0tty_tiocmget,
+	.tiocmset = tty0tty_tiocmset,
+	.break_ctl = tty0tty_break_ctl,
+	.ioctl = tty0tty_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	.get_serial = tty0tty_get_serial,
+	.set_serial = tty0tty_set_serial,
+#endif
+};
+
+static struct tty_driver *tty0tty_tty_driver;
+
+/* per device statistics in /sys/class/tty/tntX/stats */
+static ssize_t tty0tty_stats_show(struct device *dev, char *buf,
+				  size_t offset)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	struct tty0tty_stats stats;
+
+	tty0tty_get_stats(tty0tty, &stats);
+	return sprintf(buf, "%lu\n",
+		       *(unsigned long *)((char *)&stats + offset));
+}
+
+static ssize_t tx_bytes_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	return tty0tty_stats_show(dev, buf, offsetof(struct tty0tty_stats, tx));
+}
+static DEVICE_ATTR_RO(tx_bytes);
+
+static ssize_t rx_bytes_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	return tty0tty_stats_show(dev, buf, offsetof(struct tty0tty_stats, rx));
 }
+static DEVICE_ATTR_RO(rx_bytes);
 
-static int tty0tty_write(struct tty_struct *tty, const unsigned char *buffer,
-			 int count)
+static ssize_t dropped_bytes_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
-	int retval = -EINVAL;
-	struct tty_struct *ttyx = NULL;
-	struct tty0tty_serial *tts;
+	return tty0tty_stats_show(dev, buf,
+				  offsetof(struct tty0tty_stats, dropped));
+}
+static DEVICE_ATTR_RO(dropped_bytes);
 
-	if (!tty0tty)
-		return -ENODEV;
+static ssize_t buf_overrun_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	struct async_icount icount;
 
-	down(&tty0tty->sem);
+	tty0tty_get_icount(tty0tty, &icount);
+	return sprintf(buf, "%u\n", icount.buf_overrun);
+}
+static DEVICE_ATTR_RO(buf_overrun);
+
+static struct attribute *tty0tty_stats_attrs[] = {
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_dropped_bytes.attr,
+	&dev_attr_buf_overrun.attr,
+	NULL,
+};
 
-	/* port was not opened */
-	if (!tty0tty->open_count)
-		goto exit;
+static const struct attribute_group tty0tty_stats_group = {
+	.name = "stats",
+	.attrs = tty0tty_stats_attrs,
+};
 
-	tts = get_counterpart(tty0tty);
+static const struct attribute_group *tty0tty_attr_groups[] = {
+	&tty0tty_stats_group,
+	NULL,
+};
 
-	if (tts)
-		ttyx = tts->tty;
+/*
+ * debugfs tty0tty/tntX: how long writes to tntX took until their last
+ * byte was pushed to the peer, one line per log2 bucket that is in use.
+ * Writing anything clears it.
+ */
+static int tty0tty_latency_show(struct seq_file *m, void *v)
+{
+	struct tty0tty_serial *tty0tty = m->private;
+	u64 hist[TTY0TTY_LAT_BUCKETS];
+	int i;
 
-	//tty->low_latency=1;
+	spin_lock_irq(&tty0tty->xmit_lock);
+	memcpy(hist, tty0tty->lat_hist, sizeof(hist));
+	spin_unlock_irq(&tty0tty->xmit_lock);
 
-	if (ttyx != NULL) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 8, 0)
-		tty_insert_flip_string(ttyx->port, buffer, count);
-		tty_flip_buffer_push(ttyx->port);
-#else
-		tty_insert_flip_string(ttyx, buffer, count);
-		tty_flip_buffer_push(ttyx);
-#endif
-		retval = count;
+	for (i = 0; i < TTY0TTY_LAT_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == TTY0TTY_LAT_BUCKETS - 1)
+			seq_printf(m, "%llu- ns: %llu\n", 1ULL << (i - 1),
+				   hist[i]);
+		else
+			seq_printf(m, "%llu-%llu ns: %llu\n",
+				   i ? 1ULL << (i - 1) : 0,
+				   (1ULL << i) - 1, hist[i]);
 	}
-
-exit:
-	up(&tty0tty->sem);
-	return retval;
+	return 0;
 }
 
-static int tty0tty_write_room(struct tty_struct *tty)
+static int tty0tty_latency_open(struct inode *inode, struct file *file)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
-	int room = -EINVAL;
-
-	if (!tty0tty)
-		return -ENODEV;
+	return single_open(file, tty0tty_latency_show, inode->i_private);
+}
 
-	down(&tty0tty->sem);
+static ssize_t tty0tty_latency_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tty0tty_serial *tty0tty = m->private;
 
-	/* port was not opened */
-	if (!tty0tty->open_count)
-		goto exit;
+	spin_lock_irq(&tty0tty->xmit_lock);
+	memset(tty0tty->lat_hist, 0, sizeof(tty0tty->lat_hist));
+	spin_unlock_irq(&tty0tty->xmit_lock);
+	return count;
+}
 
-	/* calculate how much room is left in the device */
-	room = 255;
+static const struct file_operations tty0tty_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = tty0tty_latency_open,
+	.read = seq_read,
+	.write = tty0tty_latency_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-exit:
-	up(&tty0tty->sem);
-	return room;
+static void tty0tty_init_serial(struct tty0tty_serial *tty0tty,
+				struct tty0tty_pair *pair)
+{
+	tty_port_init(&tty0tty->port);
+	tty0tty->port.ops = &tty0tty_port_ops;
+	tty0tty->pair = pair;
+	spin_lock_init(&tty0tty->lock);
+	INIT_LIST_HEAD(&tty0tty->bus_node);
+	init_waitqueue_head(&tty0tty->wait);
+	init_waitqueue_head(&tty0tty->ring_wait);
+	spin_lock_init(&tty0tty->xmit_lock);
+	INIT_DELAYED_WORK(&tty0tty->tx_work, tty0tty_tx_work);
+	INIT_KFIFO(tty0tty->tx_marks);
+	hrtimer_init(&tty0tty->push_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tty0tty->push_timer.function = tty0tty_push_timer;
+	tty0tty->xmit_size = fifo_size;
+	tty0tty->coalesce_bytes = coalesce_bytes;
+	tty0tty->coalesce_usecs = coalesce_usecs;
+	hrtimer_init(&tty0tty->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	tty0tty->tx_timer.function = tty0tty_tx_timer;
+	tty0tty->pacing = pacing;
 }
 
-#define RELEVANT_IFLAG(iflag) ((iflag) & (IGNBRK|BRKINT|IGNPAR|PARMRK|INPCK))
-
-static void tty0tty_set_termios(struct tty_struct *tty,
-				struct ktermios *old_termios)
+/*
+ * Create pair index, or the first free one if index is negative, and
+ * return its number. Only the pair itself is allocated here, on node or
+ * the local one for NUMA_NO_NODE; the transmit FIFOs wait for the first
+ * open.
+ */
+static int tty0tty_create_pair(int index, int node)
 {
-	unsigned int cflag;
-	unsigned int iflag;
+	struct tty0tty_pair *pair;
+	struct device *dev;
+	int retval;
+	int i;
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
+	if (index >= (int)max_pairs)
+		return -EINVAL;
+	if (node != NUMA_NO_NODE &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return -EINVAL;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
-	cflag = tty->termios.c_cflag;
-	iflag = tty->termios.c_iflag;
-#else
-	cflag = tty->termios->c_cflag;
-	iflag = tty->termios->c_iflag;
-#endif
+	pair = kmem_cache_alloc_node(tty0tty_pair_cache,
+				     GFP_KERNEL | __GFP_ZERO, node);
+	if (!pair)
+		return -ENOMEM;
+	pair->node = node;
 
-	/* check that they really want us to change something */
-	if (old_termios) {
-		if ((cflag == old_termios->c_cflag) &&
-		    (RELEVANT_IFLAG(iflag) ==
-		     RELEVANT_IFLAG(old_termios->c_iflag))) {
-			dev_dbg(tty->dev, " - nothing to change...\n");
-			return;
+	for (i = 0; i < 2; i++) {
+		pair->serial[i].stats = alloc_percpu(struct tty0tty_stats);
+		if (!pair->serial[i].stats) {
+			free_percpu(pair->serial[0].stats);
+			kmem_cache_free(tty0tty_pair_cache, pair);
+			return -ENOMEM;
 		}
+		tty0tty_init_serial(&pair->serial[i], pair);
+		pair->serial[i].peer = &pair->serial[i ^ 1];
 	}
-	/* get the byte size */
-	switch (cflag & CSIZE) {
-	case CS5:
-		dev_dbg(tty->dev, " - data bits = 5\n");
-		break;
-	case CS6:
-		dev_dbg(tty->dev, " - data bits = 6\n");
-		break;
-	case CS7:
-		dev_dbg(tty->dev, " - data bits = 7\n");
-		break;
-	default:
-	case CS8:
-		dev_dbg(tty->dev, " - data bits = 8\n");
-		break;
-	}
-
-	/* determine the parity */
-	if (cflag & PARENB)
-		if (cflag & PARODD)
-			dev_dbg(tty->dev, " - parity = odd\n");
-		else
-			dev_dbg(tty->dev, " - parity = even\n");
-	else
-		dev_dbg(tty->dev, " - parity = none\n");
-
-	/* figure out the stop bits requested */
-	if (cflag & CSTOPB)
-		dev_dbg(tty->dev, " - stop bits = 2\n");
-	else
-		dev_dbg(tty->dev, " - stop bits = 1\n");
 
-	/* figure out the hardware flow control settings */
-	if (cflag & CRTSCTS)
-		dev_dbg(tty->dev, " - RTS/CTS is enabled\n");
-	else
-		dev_dbg(tty->dev, " - RTS/CTS is disabled\n");
+	/* from here on the pair belongs to its two ports */
+	kref_init(&pair->kref);
+	kref_get(&pair->kref);
 
-	/* determine software flow control */
-	/* if we are implementing XON/XOFF, set the start and
-	 * stop character in the device
-	 */
-	if (I_IXOFF(tty) || I_IXON(tty)) {
-		unsigned char stop_char = STOP_CHAR(tty);
-		unsigned char start_char = START_CHAR(tty);
-
-		/* if we are implementing INBOUND XON/XOFF */
-		if (I_IXOFF(tty))
-			dev_dbg(tty->dev, " - INBOUND XON/XOFF is enabled, XON = %2x, XOFF = %2x\n",
-					start_char, stop_char);
-		else
-			dev_dbg(tty->dev, " - INBOUND XON/XOFF is disabled\n");
+	mutex_lock(&tty0tty_pairs_lock);
 
-		/* if we are implementing OUTBOUND XON/XOFF */
-		if (I_IXON(tty))
-			dev_dbg(tty->dev, " - OUTBOUND XON/XOFF is enabled, XON = %2x, XOFF = %2x\n",
-					start_char, stop_char);
-		else
-			dev_dbg(tty->dev, " - OUTBOUND XON/XOFF is disabled\n");
+	if (index < 0) {
+		for (index = 0; index < max_pairs; index++)
+			if (!tty0tty_pairs[index])
+				break;
+		if (index == max_pairs) {
+			retval = -ENOSPC;
+			goto err_unlock;
+		}
+	} else if (tty0tty_pairs[index]) {
+		/* still held by the ttys of a destroyed pair */
+		retval = tty0tty_pairs[index]->dead ? -EBUSY : -EEXIST;
+		goto err_unlock;
 	}
 
-	/* get the baud rate wanted */
-	dev_dbg(tty->dev, " - baud rate = %d\n", tty_get_baud_rate(tty));
-}
+	pair->index = index;
+	for (i = 0; i < 2; i++) {
+		pair->serial[i].index = 2 * index + i;
+		dev = tty_register_device_attr(tty0tty_tty_driver,
+					       2 * index + i, NULL,
+					       &pair->serial[i],
+					       tty0tty_attr_groups);
+		if (IS_ERR(dev)) {
+			pr_err("failed to register tty0tty device %d",
+			       2 * index + i);
+			retval = PTR_ERR(dev);
+			while (i--)
+				tty_unregister_device(tty0tty_tty_driver,
+						      2 * index + i);
+			goto err_unlock;
+		}
+	}
 
-static int tty0tty_tiocmget(struct tty_struct *tty)
-{
-	struct tty0tty_serial *tty0tty = tty->driver_data;
+	for (i = 0; i < 2; i++) {
+		char name[16];
 
-	unsigned int result = 0;
-	unsigned int msr = tty0tty->msr;
-	unsigned int mcr = tty0tty->mcr;
+		snprintf(name, sizeof(name), "tnt%d", 2 * index + i);
+		pair->serial[i].debugfs =
+			debugfs_create_file(name, 0600, tty0tty_debugfs,
+					    &pair->serial[i],
+					    &tty0tty_latency_fops);
+	}
 
-	result = ((mcr & MCR_DTR) ? TIOCM_DTR : 0) |	/* DTR is set */
-	    ((mcr & MCR_RTS) ? TIOCM_RTS : 0) |	/* RTS is set */
-	    ((mcr & MCR_LOOP) ? TIOCM_LOOP : 0) |	/* LOOP is set */
-	    ((msr & MSR_CTS) ? TIOCM_CTS : 0) |	/* CTS is set */
-	    ((msr & MSR_CD) ? TIOCM_CAR : 0) |	/* Carrier detect is set */
-	    ((msr & MSR_RI) ? TIOCM_RI : 0) |	/* Ring Indicator is set */
-	    ((msr & MSR_DSR) ? TIOCM_DSR : 0);	/* DSR is set */
+	tty0tty_pairs[index] = pair;
+	mutex_unlock(&tty0tty_pairs_lock);
+	return index;
 
-	return result;
+err_unlock:
+	mutex_unlock(&tty0tty_pairs_lock);
+	tty_port_put(&pair->serial[0].port);
+	tty_port_put(&pair->serial[1].port);
+	return retval;
 }
 
-static int tty0tty_tiocmset(struct tty_struct *tty,
-			    unsigned int set, unsigned int clear)
+/* take tts off its bus, if any; called with tty0tty_pairs_lock held */
+static void tty0tty_bus_leave(struct tty0tty_serial *tts)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
-	unsigned int mcr = tty0tty->mcr;
-	unsigned int msr = 0;
-	struct tty0tty_serial *tts = get_counterpart(tty0tty);
+	struct tty0tty_bus *bus;
 
-	if (tts)
-		msr = tts->msr;
+	bus = rcu_dereference_protected(tts->bus,
+					lockdep_is_held(&tty0tty_pairs_lock));
+	if (!bus)
+		return;
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
+	list_del_rcu(&tts->bus_node);
+	RCU_INIT_POINTER(tts->bus, NULL);
 
-	//null modem connection
+	/* no writer walks the old list any more once this returns */
+	synchronize_rcu();
+	INIT_LIST_HEAD(&tts->bus_node);
 
-	if (set & TIOCM_RTS) {
-		mcr |= MCR_RTS;
-		msr |= MSR_CTS;
+	if (list_empty(&bus->members)) {
+		list_del(&bus->node);
+		kfree(bus);
+		static_branch_dec(&tty0tty_bus_key);
 	}
+}
 
-	if (set & TIOCM_DTR) {
-		mcr |= MCR_DTR;
-		msr |= MSR_DSR;
-		msr |= MSR_CD;
+/*
+ * Move port tntX to bus id, creating the bus on first use; id 0 takes
+ * it off its bus and back to its pair peer.
+ */
+static int tty0tty_bus_set(int port, u32 id)
+{
+	struct tty0tty_serial *tts;
+	struct tty0tty_pair *pair;
+	struct tty0tty_bus *bus;
+	int retval = 0;
+
+	if (port < 0 || port >= 2 * max_pairs)
+		return -EINVAL;
+
+	mutex_lock(&tty0tty_pairs_lock);
+	pair = tty0tty_pair_lookup(port / 2);
+	if (!pair) {
+		retval = -ENOENT;
+		goto out;
 	}
-
-	if (clear & TIOCM_RTS) {
-		mcr &= ~MCR_RTS;
-		msr &= ~MSR_CTS;
+	tts = &pair->serial[port % 2];
+
+	bus = rcu_dereference_protected(tts->bus,
+					lockdep_is_held(&tty0tty_pairs_lock));
+	if (bus && bus->id == id)
+		goto out;
+	tty0tty_bus_leave(tts);
+	if (!id)
+		goto out;
+
+	list_for_each_entry(bus, &tty0tty_buses, node)
+		if (bus->id == id)
+			goto join;
+
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		retval = -ENOMEM;
+		goto out;
 	}
+	bus->id = id;
+	INIT_LIST_HEAD(&bus->members);
+	list_add(&bus->node, &tty0tty_buses);
+	static_branch_inc(&tty0tty_bus_key);
+join:
+	list_add_tail_rcu(&tts->bus_node, &bus->members);
+	rcu_assign_pointer(tts->bus, bus);
+out:
+	mutex_unlock(&tty0tty_pairs_lock);
+	return retval;
+}
 
-	if (clear & TIOCM_DTR) {
-		mcr &= ~MCR_DTR;
-		msr &= ~MSR_DSR;
-		msr &= ~MSR_CD;
+static int tty0tty_bus_get(int port, u32 *id)
+{
+	struct tty0tty_pair *pair;
+	struct tty0tty_bus *bus;
+	int retval = 0;
+
+	if (port < 0 || port >= 2 * max_pairs)
+		return -EINVAL;
+
+	mutex_lock(&tty0tty_pairs_lock);
+	pair = tty0tty_pair_lookup(port / 2);
+	if (pair) {
+		bus = rcu_dereference_protected(pair->serial[port % 2].bus,
+				lockdep_is_held(&tty0tty_pairs_lock));
+		*id = bus ? bus->id : 0;
+	} else {
+		retval = -ENOENT;
 	}
+	mutex_unlock(&tty0tty_pairs_lock);
+	return retval;
+}
 
-	/* set the new MCR value in the device */
-	tty0tty->mcr = mcr;
+/*
+ * Remove the devices of a pair and hang up whoever still has them open;
+ * the memory and the slot go away with the last reference to its ports.
+ */
+static int tty0tty_destroy_pair(int index)
+{
+	struct tty0tty_pair *pair;
+	int i;
 
-	if (tts)
-		tts->msr = msr;
+	if (index < 0 || index >= max_pairs)
+		return -EINVAL;
 
+	mutex_lock(&tty0tty_pairs_lock);
+	pair = tty0tty_pair_lookup(index);
+	if (!pair) {
+		mutex_unlock(&tty0tty_pairs_lock);
+		return -ENOENT;
+	}
+	WRITE_ONCE(pair->dead, true);
+	for (i = 0; i < 2; i++)
+		tty0tty_bus_leave(&pair->serial[i]);
+	mutex_unlock(&tty0tty_pairs_lock);
+
+	for (i = 0; i < 2; i++) {
+		debugfs_remove(pair->serial[i].debugfs);
+		tty_unregister_device(tty0tty_tty_driver, 2 * index + i);
+		tty_port_tty_hangup(&pair->serial[i].port, false);
+		tty_port_put(&pair->serial[i].port);
+	}
 	return 0;
 }
 
-static int tty0tty_ioctl_tiocgserial(struct tty_struct *tty,
-				     unsigned int cmd, unsigned long arg)
+/*
+ * Tap pair index for the process holding file open; the capture lasts
+ * until the file is released, one tap per pair at a time.
+ */
+static int tty0tty_tap_attach(struct file *file, int index)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_tap_ring *ring;
+	struct tty0tty_tap *tap;
+	struct tty0tty_pair *pair;
+	unsigned int cpu;
+	int retval = 0;
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
-	if (cmd == TIOCGSERIAL) {
-		struct serial_struct tmp;
+	if (index < 0 || index >= max_pairs)
+		return -EINVAL;
 
-		if (!arg)
-			return -EFAULT;
+	tap = kzalloc(sizeof(*tap), GFP_KERNEL);
+	if (!tap)
+		return -ENOMEM;
+	tap->head = alloc_percpu(u64);
+	if (!tap->head) {
+		kfree(tap);
+		return -ENOMEM;
+	}
+	tap->stride = PAGE_SIZE + tap_size;
+	tap->area = vmalloc_user(nr_cpu_ids * tap->stride);
+	if (!tap->area) {
+		free_percpu(tap->head);
+		kfree(tap);
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&tap->wait);
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		ring = tty0tty_tap_ring(tap, cpu);
+		ring->size = tap_size;
+		ring->stride = tap->stride;
+		ring->nr_rings = nr_cpu_ids;
+		ring->data_offset = PAGE_SIZE;
+	}
 
-		memset(&tmp, 0, sizeof(tmp));
-
-		tmp.type = tty0tty->serial.type;
-		tmp.line = tty0tty->serial.line;
-		tmp.port = tty0tty->serial.port;
-		tmp.irq = tty0tty->serial.irq;
-		tmp.flags = ASYNC_SKIP_TEST | ASYNC_AUTO_IRQ;
-		tmp.xmit_fifo_size = tty0tty->serial.xmit_fifo_size;
-		tmp.baud_base = tty0tty->serial.baud_base;
-		tmp.close_delay = 5 * HZ;
-		tmp.closing_wait = 30 * HZ;
-		tmp.custom_divisor = tty0tty->serial.custom_divisor;
-		tmp.hub6 = tty0tty->serial.hub6;
-		tmp.io_type = tty0tty->serial.io_type;
+	mutex_lock(&tty0tty_pairs_lock);
+	pair = tty0tty_pair_lookup(index);
+	if (file->private_data)
+		retval = -EBUSY;
+	else if (!pair)
+		retval = -ENOENT;
+	else if (rcu_access_pointer(pair->tap))
+		retval = -EBUSY;
+	if (!retval) {
+		kref_get(&pair->kref);
+		tap->pair = pair;
+		static_branch_inc(&tty0tty_tap_key);
+		rcu_assign_pointer(pair->tap, tap);
+		smp_store_release(&file->private_data, tap);
+	}
+	mutex_unlock(&tty0tty_pairs_lock);
 
-		if (copy_to_user
-		    ((void __user *)arg, &tmp, sizeof(struct serial_struct)))
-			return -EFAULT;
-		return 0;
+	if (retval) {
+		vfree(tap->area);
+		free_percpu(tap->head);
+		kfree(tap);
 	}
-	return -ENOIOCTLCMD;
+	return retval;
 }
 
-static int tty0tty_ioctl_tiocmiwait(struct tty_struct *tty,
-				    unsigned int cmd, unsigned long arg)
+static void tty0tty_tap_detach(struct tty0tty_tap *tap)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
-
-	dev_dbg(tty->dev, "%s -\n", __func__);
+	struct tty0tty_pair *pair = tap->pair;
 
-	if (cmd == TIOCMIWAIT) {
-		DECLARE_WAITQUEUE(wait, current);
-		struct async_icount cnow;
-		struct async_icount cprev;
+	mutex_lock(&tty0tty_pairs_lock);
+	RCU_INIT_POINTER(pair->tap, NULL);
+	mutex_unlock(&tty0tty_pairs_lock);
+	static_branch_dec(&tty0tty_tap_key);
 
-		cprev = tty0tty->icount;
-		while (1) {
-			add_wait_queue(&tty0tty->wait, &wait);
-			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
-			remove_wait_queue(&tty0tty->wait, &wait);
+	/* writers still copying into the rings are done after this */
+	synchronize_rcu();
 
-			/* see if a signal woke us up */
-			if (signal_pending(current))
-				return -ERESTARTSYS;
+	vfree(tap->area);
+	free_percpu(tap->head);
+	kfree(tap);
+	kref_put(&pair->kref, tty0tty_pair_release);
+}
 
-			cnow = tty0tty->icount;
-			if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
-			    cnow.dcd == cprev.dcd && cnow.cts == cprev.cts)
-				return -EIO;	/* no change => error */
-			if (((arg & TIOCM_RNG) && (cnow.rng != cprev.rng)) ||
-			    ((arg & TIOCM_DSR) && (cnow.dsr != cprev.dsr)) ||
-			    ((arg & TIOCM_CD) && (cnow.dcd != cprev.dcd)) ||
-			    ((arg & TIOCM_CTS) && (cnow.cts != cprev.cts))) {
-				return 0;
-			}
-			cprev = cnow;
-		}
-	}
-	return -ENOIOCTLCMD;
+static int tty0tty_ctl_open(struct inode *inode, struct file *file)
+{
+	/* no tap yet, misc_open left the miscdevice here */
+	file->private_data = NULL;
+	return 0;
 }
 
-static int tty0tty_ioctl_tiocgicount(struct tty_struct *tty,
-				     unsigned int cmd, unsigned long arg)
+static int tty0tty_ctl_release(struct inode *inode, struct file *file)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_tap *tap = file->private_data;
 
-	dev_dbg(tty->dev, "%s -\n", __func__);
+	if (tap)
+		tty0tty_tap_detach(tap);
+	return 0;
+}
 
-	if (cmd == TIOCGICOUNT) {
-		struct async_icount cnow = tty0tty->icount;
-		struct serial_icounter_struct icount;
+static int tty0tty_ctl_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tty0tty_tap *tap = smp_load_acquire(&file->private_data);
 
-		icount.cts = cnow.cts;
-		icount.dsr = cnow.dsr;
-		icount.rng = cnow.rng;
-		icount.dcd = cnow.dcd;
-		icount.rx = cnow.rx;
-		icount.tx = cnow.tx;
-		icount.frame = cnow.frame;
-		icount.overrun = cnow.overrun;
-		icount.parity = cnow.parity;
-		icount.brk = cnow.brk;
-		icount.buf_overrun = cnow.buf_overrun;
+	if (!tap)
+		return -EINVAL;
 
-		if (copy_to_user((void __user *)arg, &icount, sizeof(icount)))
-			return -EFAULT;
-		return 0;
+	return remap_vmalloc_range(vma, tap->area, vma->vm_pgoff);
+}
+
+/* readable while any of the rings holds records */
+static __poll_t tty0tty_ctl_poll(struct file *file, poll_table *wait)
+{
+	struct tty0tty_tap *tap = smp_load_acquire(&file->private_data);
+	struct tty0tty_tap_ring *ring;
+	unsigned int cpu;
+
+	if (!tap)
+		return EPOLLERR;
+
+	poll_wait(file, &tap->wait, wait);
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		ring = tty0tty_tap_ring(tap, cpu);
+		if (READ_ONCE(ring->head) != READ_ONCE(ring->tail))
+			return EPOLLIN | EPOLLRDNORM;
 	}
-	return -ENOIOCTLCMD;
+	return 0;
 }
 
-static int tty0tty_ioctl(struct tty_struct *tty,
-			 unsigned int cmd, unsigned long arg)
+/* /dev/tty0tty creates and destroys pairs on demand */
+static long tty0tty_ctl_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
 {
-	dev_dbg(tty->dev, "%s - %04X\n", __func__, cmd);
+	int __user *argp = (int __user *)arg;
+	struct tty0tty_bus_req req;
+	struct tty0tty_create creq;
+	int index;
+	int retval;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
 
 	switch (cmd) {
-	case TIOCGSERIAL:
-		return tty0tty_ioctl_tiocgserial(tty, cmd, arg);
-	case TIOCMIWAIT:
-		return tty0tty_ioctl_tiocmiwait(tty, cmd, arg);
-	case TIOCGICOUNT:
-		return tty0tty_ioctl_tiocgicount(tty, cmd, arg);
+	case TTY0TTY_IOCCREATE:
+		if (get_user(index, argp))
+			return -EFAULT;
+		retval = tty0tty_create_pair(index, NUMA_NO_NODE);
+		if (retval < 0)
+			return retval;
+		return put_user(retval, argp);
+	case TTY0TTY_IOCCREATEON:
+		if (copy_from_user(&creq, argp, sizeof(creq)))
+			return -EFAULT;
+		retval = tty0tty_create_pair(creq.pair, creq.node);
+		if (retval < 0)
+			return retval;
+		creq.pair = retval;
+		return copy_to_user(argp, &creq, sizeof(creq)) ? -EFAULT : 0;
+	case TTY0TTY_IOCDESTROY:
+		if (get_user(index, argp))
+			return -EFAULT;
+		return tty0tty_destroy_pair(index);
+	case TTY0TTY_IOCTAP:
+		if (get_user(index, argp))
+			return -EFAULT;
+		return tty0tty_tap_attach(file, index);
+	case TTY0TTY_IOCSBUS:
+		if (copy_from_user(&req, argp, sizeof(req)))
+			return -EFAULT;
+		return tty0tty_bus_set(req.port, req.bus);
+	case TTY0TTY_IOCGBUS:
+		if (copy_from_user(&req, argp, sizeof(req)))
+			return -EFAULT;
+		retval = tty0tty_bus_get(req.port, &req.bus);
+		if (retval)
+			return retval;
+		return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
 	}
 
-	return -ENOIOCTLCMD;
+	return -ENOTTY;
 }
 
-static const struct tty_operations serial_ops = {
-	.open = tty0tty_open,
-	.close = tty0tty_close,
-	.write = tty0tty_write,
-	.write_room = tty0tty_write_room,
-	.set_termios = tty0tty_set_termios,
-	.tiocmget = tty0tty_tiocmget,
-	.tiocmset = tty0tty_tiocmset,
-	.ioctl = tty0tty_ioctl,
+static const struct file_operations tty0tty_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = tty0tty_ctl_open,
+	.release = tty0tty_ctl_release,
+	.unlocked_ioctl = tty0tty_ctl_ioctl,
+	.compat_ioctl = tty0tty_ctl_ioctl,
+	.mmap = tty0tty_ctl_mmap,
+	.poll = tty0tty_ctl_poll,
+	.llseek = noop_llseek,
 };
 
-static struct tty_driver *tty0tty_tty_driver;
+static struct miscdevice tty0tty_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "tty0tty",
+	.fops = &tty0tty_ctl_fops,
+};
 
 static int __init tty0tty_init(void)
 {
 	int retval;
 	int i;
 
-	pairs = clamp_val(pairs, 1, 128);
-	tport = kmalloc(2 * pairs * sizeof(struct tty_port), GFP_KERNEL);
-	tty0tty_table =
-	    kmalloc(2 * pairs * sizeof(struct tty0tty_serial *), GFP_KERNEL);
-
-	for (i = 0; i < 2 * pairs; i++)
-		tty0tty_table[i] = NULL;
+	max_pairs = clamp_val(max_pairs, 1, 16384);
+	pairs = clamp_val(pairs, 0, max_pairs);
+	fifo_size = roundup_pow_of_two(clamp_val(fifo_size, 256, 1 << 20));
+	coalesce_usecs = clamp_val(coalesce_usecs, 1, USEC_PER_SEC);
+	pacing_slice_usecs = clamp_val(pacing_slice_usecs, 100, USEC_PER_SEC);
+	tap_size = roundup_pow_of_two(clamp_val(tap_size, PAGE_SIZE, 1 << 24));
+	ring_size = roundup_pow_of_two(clamp_val(ring_size, PAGE_SIZE, 1 << 24));
+	tty0tty_pair_cache = kmem_cache_create("tty0tty_pair",
+					       sizeof(struct tty0tty_pair), 0,
+					       SLAB_HWCACHE_ALIGN, NULL);
+	if (!tty0tty_pair_cache)
+		return -ENOMEM;
+	tty0tty_pairs = kcalloc(max_pairs, sizeof(*tty0tty_pairs), GFP_KERNEL);
+	if (!tty0tty_pairs) {
+		kmem_cache_destroy(tty0tty_pair_cache);
+		return -ENOMEM;
+	}
 
 	pr_debug("%s -\n", __func__);
 
 	/* allocate the tty driver */
-	tty0tty_tty_driver = alloc_tty_driver(2 * pairs);
-	if (!tty0tty_tty_driver)
-		return -ENOMEM;
+	tty0tty_tty_driver = alloc_tty_driver(2 * max_pairs);
+	if (!tty0tty_tty_driver) {
+		retval = -ENOMEM;
+		goto err_free;
+	}
 
 	/* initialize the tty driver */
 	tty0tty_tty_driver->owner = THIS_MODULE;
@@ -557,7 +3081,8 @@ static int __init tty0tty_init(void)
 	tty0tty_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
 	tty0tty_tty_driver->subtype = SERIAL_TYPE_NORMAL;
 	tty0tty_tty_driver->flags =
-	    TTY_DRIVER_RESET_TERMIOS | TTY_DRIVER_REAL_RAW;
+	    TTY_DRIVER_RESET_TERMIOS | TTY_DRIVER_REAL_RAW |
+	    TTY_DRIVER_DYNAMIC_DEV;
 	/* no more devfs subsystem */
 	tty0tty_tty_driver->init_termios = tty_std_termios;
 	tty0tty_tty_driver->init_termios.c_iflag = 0;
@@ -569,54 +3094,62 @@ static int __init tty0tty_init(void)
 
 	tty_set_operations(tty0tty_tty_driver, &serial_ops);
 
-	for (i = 0; i < 2 * pairs; i++) {
-		tty_port_init(&tport[i]);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
-		tty_port_link_device(&tport[i], tty0tty_tty_driver, i);
-#endif
-	}
-
 	retval = tty_register_driver(tty0tty_tty_driver);
 	if (retval) {
 		pr_err("failed to register tty0tty tty driver");
-		put_tty_driver(tty0tty_tty_driver);
-		return retval;
+		goto err_put;
+	}
+
+	tty0tty_debugfs = debugfs_create_dir("tty0tty", NULL);
+	if (latency_hist)
+		static_branch_enable(&tty0tty_lat_key);
+
+	retval = misc_register(&tty0tty_ctl);
+	if (retval) {
+		pr_err("failed to register tty0tty control device");
+		goto err_unregister;
+	}
+
+	for (i = 0; i < pairs; i++) {
+		retval = tty0tty_create_pair(i, pair_node);
+		if (retval < 0)
+			goto err_destroy;
 	}
 
 	pr_info(DRIVER_DESC " " DRIVER_VERSION "\n");
+	return 0;
+
+err_destroy:
+	while (i--)
+		tty0tty_destroy_pair(i);
+	misc_deregister(&tty0tty_ctl);
+err_unregister:
+	debugfs_remove_recursive(tty0tty_debugfs);
+	tty_unregister_driver(tty0tty_tty_driver);
+err_put:
+	put_tty_driver(tty0tty_tty_driver);
+err_free:
+	kfree(tty0tty_pairs);
+	kmem_cache_destroy(tty0tty_pair_cache);
 	return retval;
 }
 
 static void __exit tty0tty_exit(void)
 {
-	struct tty0tty_serial *tty0tty;
 	int i;
 
 	pr_debug("%s -\n", __func__);
 
-	for (i = 0; i < 2 * pairs; ++i) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
-		tty_port_destroy(&tport[i]);
-#endif
-		tty_unregister_device(tty0tty_tty_driver, i);
-	}
-	tty_unregister_driver(tty0tty_tty_driver);
+	/* no new pairs from here on; open ports keep the module loaded */
+	misc_deregister(&tty0tty_ctl);
+	for (i = 0; i < max_pairs; ++i)
+		tty0tty_destroy_pair(i);
+	debugfs_remove_recursive(tty0tty_debugfs);
 
-	/* shut down all of the timers and free the memory */
-	for (i = 0; i < 2 * pairs; ++i) {
-		tty0tty = tty0tty_table[i];
-		if (tty0tty) {
-			/* close the port */
-			while (tty0tty->open_count)
-				do_close(tty0tty);
-
-			/* shut down our timer and free the memory */
-			kfree(tty0tty);
-			tty0tty_table[i] = NULL;
-		}
-	}
-	kfree(tport);
-	kfree(tty0tty_table);
+	tty_unregister_driver(tty0tty_tty_driver);
+	put_tty_driver(tty0tty_tty_driver);
+	kfree(tty0tty_pairs);
+	kmem_cache_destroy(tty0tty_pair_cache);
 }
 
 module_init(tty0tty_init);
@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: (GPL-2.0+ OR BSD-3-Clause) */
+/*
+ * tty0tty - linux null modem emulator (module) for kernel > 3.8
+ *
+ * Driver specific ioctls, shared with userspace tools.
+ */
+
+#ifndef _TTY0TTY_H
+#define _TTY0TTY_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define TTY0TTY_IOC_MAGIC	0xB5
+
+/* per-port mode flags */
+#define TTY0TTY_PACING		0x0001	/* deliver data at line speed */
+#define TTY0TTY_LOW_LATENCY	0x0002	/* hand small writes to the peer */
+
+#define TTY0TTY_FLAGS_MASK	(TTY0TTY_PACING | TTY0TTY_LOW_LATENCY)
+
+/* get and set the mode flags of a /dev/tntX port */
+#define TTY0TTY_IOCGFLAGS	_IOR(TTY0TTY_IOC_MAGIC, 0x00, __u32)
+#define TTY0TTY_IOCSFLAGS	_IOW(TTY0TTY_IOC_MAGIC, 0x01, __u32)
+
+/*
+ * TTY0TTY_IOCGCONFIG and TTY0TTY_IOCSCONFIG read and change the tuning of
+ * a /dev/tntX port at runtime; the defaults come from the module
+ * parameters of the same names. Changing fifo_size or baud_base needs
+ * CAP_SYS_ADMIN, and fifo_size fails with EBUSY while data is queued.
+ * TIOCSSERIAL changes the same settings through ASYNC_LOW_LATENCY,
+ * xmit_fifo_size and baud_base.
+ */
+struct tty0tty_config {
+	__u32 flags;		/* TTY0TTY_PACING, TTY0TTY_LOW_LATENCY */
+	__u32 fifo_size;	/* 256 to 1 MiB, rounded up to a power of two */
+	__u32 coalesce_bytes;	/* push threshold, 0 pushes every write */
+	__u32 coalesce_usecs;	/* longest unpushed bytes wait, at least 1 */
+	__u32 baud_base;	/* fastest line rate for pacing, 0 for any */
+};
+
+#define TTY0TTY_IOCGCONFIG	_IOR(TTY0TTY_IOC_MAGIC, 0x06, struct tty0tty_config)
+#define TTY0TTY_IOCSCONFIG	_IOW(TTY0TTY_IOC_MAGIC, 0x07, struct tty0tty_config)
+
+/*
+ * TTY0TTY_IOCRING on /dev/tntX returns a file descriptor that maps the
+ * shared ring of the pair, and takes an eventfd (or -1) to signal when
+ * the rings changed. The mapping starts with struct tty0tty_ring ring[2];
+ * ring[i] carries the data sent by tnt(2n + i), from data_offset on.
+ * While the descriptor is open, the peer's data arrives in the ring of
+ * the peer instead of the tty of this port. This port sends by adding to
+ * head of its ring, receives by advancing tail of the peer's ring, and
+ * tells the driver with TTY0TTY_IOCKICK on the ring descriptor; a peer
+ * not using the ring keeps reading and writing its tty as usual. The
+ * descriptor also polls readable and writable for the two rings.
+ */
+#define TTY0TTY_IOCRING		_IOW(TTY0TTY_IOC_MAGIC, 0x02, __s32)
+#define TTY0TTY_IOCKICK		_IO(TTY0TTY_IOC_MAGIC, 0x03)
+
+struct tty0tty_ring {
+	__u64 head;		/* bytes added by the sender */
+	__u32 size;		/* bytes of data, a power of two */
+	__u32 data_offset;	/* from the start of the mapping */
+	__u8 __pad0[48];
+	__u64 tail;		/* bytes taken by the receiver */
+	__u8 __pad1[56];
+};
+
+/*
+ * Line errors injected into what a /dev/tntX port receives, in bytes per
+ * million: that share of the bytes arrives flagged TTY_FRAME or
+ * TTY_PARITY and is counted in TIOCGICOUNT. Both 0, the default, is a
+ * clean line; together they are at most TTY0TTY_NOISE_MAX.
+ */
+struct tty0tty_noise {
+	__u32 frame;		/* framing errors per million bytes */
+	__u32 parity;		/* parity errors per million bytes */
+};
+
+#define TTY0TTY_NOISE_MAX	1000000
+
+#define TTY0TTY_IOCGNOISE	_IOR(TTY0TTY_IOC_MAGIC, 0x04, struct tty0tty_noise)
+#define TTY0TTY_IOCSNOISE	_IOW(TTY0TTY_IOC_MAGIC, 0x05, struct tty0tty_noise)
+
+/*
+ * create and destroy pairs through /dev/tty0tty; pair n owns the devices
+ * tnt(2n) and tnt(2n+1). TTY0TTY_IOCCREATE takes the wanted pair number,
+ * or -1 for the first free one, and returns the number it used.
+ */
+#define TTY0TTY_IOCCREATE	_IOWR(TTY0TTY_IOC_MAGIC, 0x10, __s32)
+#define TTY0TTY_IOCDESTROY	_IOW(TTY0TTY_IOC_MAGIC, 0x11, __s32)
+
+/*
+ * TTY0TTY_IOCCREATEON is TTY0TTY_IOCCREATE with the NUMA node the pair
+ * and its FIFOs are allocated on; node -1 puts the pair on the local node
+ * and each FIFO on the node of the first process opening its port.
+ */
+struct tty0tty_create {
+	__s32 pair;		/* wanted pair, -1 for any; set to the one used */
+	__s32 node;
+};
+
+#define TTY0TTY_IOCCREATEON	_IOWR(TTY0TTY_IOC_MAGIC, 0x15, struct tty0tty_create)
+
+/*
+ * TTY0TTY_IOCTAP on an open /dev/tty0tty captures what both ends of the
+ * given pair write, until that file is closed. The file then maps a
+ * struct tty0tty_tap_ring every stride bytes, one per possible CPU
+ * (nr_rings of them); map the first page to learn the layout. Each ring
+ * holds records from data_offset on: a struct tty0tty_tap_rec followed by
+ * len bytes, padded to TTY0TTY_TAP_ALIGN. The reader consumes the records
+ * between tail and head, both offsets modulo size, and advances tail;
+ * a record with TTY0TTY_TAP_WRAP continues at the start of the ring.
+ * Records from different CPUs are ordered by time_ns.
+ */
+#define TTY0TTY_IOCTAP		_IOW(TTY0TTY_IOC_MAGIC, 0x12, __s32)
+
+/*
+ * TTY0TTY_IOCSBUS on /dev/tty0tty puts port tntX on a multi-drop bus:
+ * whatever a member writes is received by all other members, and not by
+ * its pair peer any more. Members of the same bus share the number bus;
+ * 0 takes the port off its bus. TTY0TTY_IOCGBUS reads it back.
+ */
+struct tty0tty_bus_req {
+	__s32 port;		/* X of /dev/tntX */
+	__u32 bus;
+};
+
+#define TTY0TTY_IOCSBUS		_IOW(TTY0TTY_IOC_MAGIC, 0x13, struct tty0tty_bus_req)
+#define TTY0TTY_IOCGBUS		_IOWR(TTY0TTY_IOC_MAGIC, 0x14, struct tty0tty_bus_req)
+
+struct tty0tty_tap_ring {
+	__u64 head;		/* written by the driver */
+	__u64 tail;		/* written by the reader */
+	__u64 lost;		/* records dropped because the ring was full */
+	__u32 size;		/* bytes of record space, a power of two */
+	__u32 stride;		/* from one ring to the next */
+	__u32 nr_rings;
+	__u32 data_offset;	/* from the start of the ring */
+};
+
+#define TTY0TTY_TAP_ALIGN	16
+#define TTY0TTY_TAP_WRAP	0x0001	/* skip to the start of the ring */
+
+struct tty0tty_tap_rec {
+	__u64 time_ns;		/* CLOCK_MONOTONIC when it was written */
+	__u32 len;
+	__u16 port;		/* written to /dev/tntX, sent to its peer */
+	__u16 flags;
+};
+
+#endif /* _TTY0TTY_H */
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * tty0tty - linux null modem emulator (module) for kernel > 3.8
+ *
+ * Tracepoints of the data path, under events/tty0tty/ in tracefs.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tty0tty
+
+#if !defined(_TTY0TTY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TTY0TTY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* data written to port and how much of it the FIFO took */
+TRACE_EVENT(tty0tty_write,
+	TP_PROTO(unsigned int port, int count, int queued),
+	TP_ARGS(port, count, queued),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(int, count)
+		__field(int, queued)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->count = count;
+		__entry->queued = queued;
+	),
+	TP_printk("tnt%u count=%d queued=%d",
+		  __entry->port, __entry->count, __entry->queued)
+);
+
+/* bytes handed to the ldisc of port since its last push */
+TRACE_EVENT(tty0tty_push,
+	TP_PROTO(unsigned int port, unsigned int bytes),
+	TP_ARGS(port, bytes),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->bytes = bytes;
+	),
+	TP_printk("tnt%u bytes=%u", __entry->port, __entry->bytes)
+);
+
+DECLARE_EVENT_CLASS(tty0tty_port,
+	TP_PROTO(unsigned int port, int open_count),
+	TP_ARGS(port, open_count),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(int, open_count)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->open_count = open_count;
+	),
+	TP_printk("tnt%u open_count=%d", __entry->port, __entry->open_count)
+);
+
+DEFINE_EVENT(tty0tty_port, tty0tty_open,
+	TP_PROTO(unsigned int port, int open_count),
+	TP_ARGS(port, open_count)
+);
+
+DEFINE_EVENT(tty0tty_port, tty0tty_close,
+	TP_PROTO(unsigned int port, int open_count),
+	TP_ARGS(port, open_count)
+);
+
+/* the modem status lines of port changed */
+TRACE_EVENT(tty0tty_modem,
+	TP_PROTO(unsigned int port, unsigned int msr, unsigned int delta),
+	TP_ARGS(port, msr, delta),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(unsigned int, msr)
+		__field(unsigned int, delta)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->msr = msr;
+		__entry->delta = delta;
+	),
+	TP_printk("tnt%u msr=0x%02x delta=0x%02x",
+		  __entry->port, __entry->msr, __entry->delta)
+);
+
+/* bytes written to port that were lost because its peer was closed */
+TRACE_EVENT(tty0tty_drop,
+	TP_PROTO(unsigned int port, unsigned int bytes),
+	TP_ARGS(port, bytes),
+	TP_STRUCT__entry(
+		__field(unsigned int, port)
+		__field(unsigned int, bytes)
+	),
+	TP_fast_assign(
+		__entry->port = port;
+		__entry->bytes = bytes;
+	),
+	TP_printk("tnt%u bytes=%u", __entry->port, __entry->bytes)
+);
+
+#endif /* _TTY0TTY_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tty0tty_trace
+#include <trace/define_trace.h>
@@ -29,12 +29,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <termio.h>
 
-static char buffer[1024];
+#include "uring.h"
+
+// default and smallest size of the buffer of each direction
+#define BUFFER_SIZE 4096
+#define MIN_BUFFER_SIZE 64
 
 int
 ptym_open(char *pts_name, char *pts_name_s , int pts_namesz)
@@ -106,117 +117,1064 @@ tcflush(serialDev, TCIOFLUSH);
   return EXIT_SUCCESS;
 }
 
+/*
+ * A thread serving a share of the pairs. Both ends of a pair always
+ * belong to the same worker, so the data path needs no locking.
+ */
+struct worker
+{
+  pthread_t thread;
+  int cpu;          // pinned to it, -1 for the main thread
+  int epfd;
+  struct uring ring;
+
+  // completions get_sqes took off a full ring, handled by uring_loop
+  struct io_uring_cqe *backlog;
+  unsigned backlog_size;
+  unsigned backlog_head;
+  unsigned backlog_tail;
+
+  int splice;       // use_splice, until the kernel refuses it
+  int nends;
+  long load;        // sum of the weights of its pairs
+};
+
+/*
+ * Let the master report what happens to the slave along with the data;
+ * EXTPROC adds a report for every termios change of the slave.
+ */
+int
+set_packet(int fd)
+{
+  struct termios params;
+  int on = 1;
+
+  if (ioctl(fd, TIOCPKT, &on) < 0 || tcgetattr(fd, &params) < 0)
+    return -1;
+  params.c_lflag |= EXTPROC;
+  return tcsetattr(fd, TCSANOW, &params);
+}
+
+long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct speed
+{
+  speed_t code;
+  long baud;
+};
+
+static const struct speed speeds[] =
+{
+  { B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 }, { B150, 150 },
+  { B200, 200 }, { B300, 300 }, { B600, 600 }, { B1200, 1200 },
+  { B1800, 1800 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+  { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+  { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 },
+  { B500000, 500000 }, { B576000, 576000 }, { B921600, 921600 },
+  { B1000000, 1000000 }, { B1152000, 1152000 }, { B1500000, 1500000 },
+  { B2000000, 2000000 }, { B2500000, 2500000 }, { B3000000, 3000000 },
+  { B3500000, 3500000 }, { B4000000, 4000000 },
+};
+
+/* time one character takes on a line set up like params, 0 for B0 */
+long long
+frame_ns(const struct termios *params)
+{
+  speed_t code = cfgetospeed(params);
+  long bits;
+  unsigned i;
+
+  // start bit, data bits, parity and stop bits
+  bits = 1 + 5 + ((params->c_cflag & CSIZE) == CS6) +
+         2 * ((params->c_cflag & CSIZE) == CS7) +
+         3 * ((params->c_cflag & CSIZE) == CS8);
+  bits += (params->c_cflag & PARENB) ? 1 : 0;
+  bits += (params->c_cflag & CSTOPB) ? 2 : 1;
+
+  for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+  {
+    if (speeds[i].code == code)
+      return bits * 1000000000LL / speeds[i].baud;
+  }
+  return 0;
+}
+
+/* one pseudo-tty of a pair, epoll hands it back to us */
+struct end
+{
+  int fd;
+  char master[1024];
+  char slave[1024];
+  struct end *peer;
+  struct worker *w;
+  long weight;      // expected share of the traffic of its pair
+
+  // read from the peer and not yet written to fd
+  char *buffer;
+  size_t size;      // of buffer
+  size_t rsize;     // what the next read asks for, adapts to the traffic
+  size_t head;
+  size_t len;
+
+  // same, for the splice path: the data waits in a pipe instead
+  int pipe[2];
+  size_t piped;
+
+  // pacing of what this end sends, a token bucket counted in line time
+  long long frame_ns;   // one character at the line speed, 0 unpaced
+  long long credit_ns;  // line time not spent yet
+  long long last_ns;    // when credit_ns was brought up to date
+  int timerfd;          // epoll wakes us once there is credit again
+  struct __kernel_timespec pace_ts;
+
+  // io_uring retries of a pty nobody has open, backing off up to a second
+  long long retry_ns;
+  struct __kernel_timespec retry_ts;
+
+  // speed and stop bits of the slave as last seen in packet mode
+  struct termios line;
+};
+
+// pacing lets a pty send a slice worth of characters at a time
+#define PACE_SLICE_NS 1000000LL
+
+static int use_splice;
+static int use_packet;
+static int use_uring;
+static int use_pacing;
+
 void
-copydata(int fdfrom, int fdto)
+set_events(struct end *e, unsigned int events)
 {
-  ssize_t br, bw;
-  char *pbuf = buffer;
-  br = read(fdfrom, buffer, 1024);
-  if (br < 0)
+  struct epoll_event ev;
+
+  ev.events = events | EPOLLET;
+  ev.data.ptr = e;
+  if (epoll_ctl(e->w->epfd, EPOLL_CTL_MOD, e->fd, &ev) < 0)
   {
-    if (errno == EAGAIN || errno == EIO)
+    perror("epoll_ctl");
+    exit(1);
+  }
+}
+
+/* write what is pending for e, returns 0 if the pty is full */
+int
+flush_pending(struct end *e)
+{
+  ssize_t bw;
+
+  while (e->len > 0)
+  {
+    bw = write(e->fd, e->buffer + e->head, e->len);
+    if (bw > 0)
+    {
+      e->head += bw;
+      e->len -= bw;
+    }
+    else if (bw < 0 && errno == EAGAIN)
+    {
+      return 0;
+    }
+    else if (bw < 0 && errno != EINTR)
+    {
+      // nobody will ever take it
+      fprintf(stderr, "Write error on %s: %s\n", e->slave, strerror(errno));
+      e->len = 0;
+    }
+  }
+  while (e->piped > 0)
+  {
+    bw = splice(e->pipe[0], NULL, e->fd, NULL, e->piped,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bw > 0)
     {
-      br = 0;
+      e->piped -= bw;
     }
+    else if (bw < 0 && errno == EAGAIN)
+    {
+      return 0;
+    }
+    else if (bw < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "Write error on %s: %s\n", e->slave, strerror(errno));
+      // empty the pipe so it can be used again
+      while (e->piped > 0 && (bw = read(e->pipe[0], e->buffer,
+                                        e->size)) > 0)
+        e->piped -= bw;
+      e->piped = 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Move up to to->rsize bytes from from's pty into the pipe of to, so
+ * the data goes from pty to pty without passing through user space.
+ * Returns -1 with errno set like read() does.
+ */
+ssize_t
+splice_in(struct end *from, struct end *to)
+{
+  ssize_t br;
+
+  br = splice(from->fd, NULL, to->pipe[1], NULL, to->rsize,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (br < 0 && (errno == EINVAL || errno == ENOSYS))
+  {
+    // ptys of this kernel cannot splice, copy from now on
+    fprintf(stderr, "splice not supported, copying instead\n");
+    from->w->splice = 0;
+    errno = EINTR;
+  }
+  return br;
+}
+
+/*
+ * Reads that fill the whole read size mean more is waiting, so ask for
+ * more next time, up to the buffer size; sparse traffic brings the read
+ * size back down.
+ */
+void
+adapt_rsize(struct end *to, size_t got)
+{
+  if (got == to->rsize && to->rsize < to->size)
+  {
+    to->rsize *= 2;
+    if (to->rsize > to->size)
+      to->rsize = to->size;
+  }
+  else if (got < to->rsize / 8 && to->rsize > MIN_BUFFER_SIZE)
+  {
+    to->rsize /= 2;
+  }
+}
+
+/* forget what waits to be written to e, the pty is not full any more */
+void
+drop_pending(struct end *e)
+{
+  ssize_t br;
+
+  e->len = 0;
+  while (e->piped > 0 && (br = read(e->pipe[0], e->buffer, e->size)) > 0)
+    e->piped -= br;
+  e->piped = 0;
+}
+
+/* how many characters from may send now, at most max */
+size_t
+pace_budget(struct end *from, size_t max)
+{
+  long long now = now_ns();
+  long long burst;
+  size_t n;
+
+  if (!use_pacing || from->frame_ns == 0)
+    return max;
+
+  // the bucket holds at most a slice, or one character on slow lines
+  burst = from->frame_ns > PACE_SLICE_NS ? from->frame_ns : PACE_SLICE_NS;
+  from->credit_ns += now - from->last_ns;
+  if (from->credit_ns > burst)
+    from->credit_ns = burst;
+  from->last_ns = now;
+
+  n = from->credit_ns / from->frame_ns;
+  return n < max ? n : max;
+}
+
+void
+pace_charge(struct end *from, size_t sent)
+{
+  from->credit_ns -= sent * from->frame_ns;
+}
+
+/* time until from has a slice worth of characters to send again */
+long long
+pace_delay(struct end *from)
+{
+  long long burst = from->frame_ns > PACE_SLICE_NS ?
+                    from->frame_ns : PACE_SLICE_NS;
+
+  return burst - from->credit_ns;
+}
+
+/* whether both ends of a cable would agree on the framing */
+int
+same_line(const struct termios *a, const struct termios *b)
+{
+  return cfgetospeed(a) == cfgetospeed(b) &&
+         cfgetispeed(a) == cfgetispeed(b) &&
+         !((a->c_cflag ^ b->c_cflag) & CSTOPB);
+}
+
+/*
+ * A slave changed its termios: follow its line speed and give the other
+ * end the same speed and stop bits, as both ends of a real cable need.
+ * Only a change of the line of from itself is passed on, so a report
+ * that arrives late cannot undo a newer change of the other end, and the
+ * report of the change made here stops at the other end.
+ */
+void
+termios_changed(struct end *from)
+{
+  struct termios params;
+  struct end *to = from->peer;
+
+  if (tcgetattr(from->fd, &params) < 0)
+    return;
+  from->frame_ns = frame_ns(&params);
+  if (same_line(&params, &from->line))
+    return;
+  from->line = params;
+
+  if (tcgetattr(to->fd, &to->line) < 0 || same_line(&params, &to->line))
+    return;
+  cfsetospeed(&to->line, cfgetospeed(&params));
+  cfsetispeed(&to->line, cfgetispeed(&params));
+  to->line.c_cflag &= ~CSTOPB;
+  to->line.c_cflag |= params.c_cflag & CSTOPB;
+  if (tcsetattr(to->fd, TCSANOW, &to->line) < 0)
+    perror("tcsetattr");
+  to->frame_ns = frame_ns(&to->line);
+}
+
+/*
+ * In packet mode every read from a master starts with a status byte.
+ * Returns the number of data bytes that follow it in to->buffer, or 0
+ * for a status report, which is acted upon here.
+ */
+ssize_t
+take_packet(struct end *from, ssize_t br)
+{
+  unsigned char status = from->peer->buffer[0];
+
+  if (status == TIOCPKT_DATA)
+    return br - 1;
+
+  // the slave flushed its input, so did the far end of the cable; with
+  // io_uring a write of that data may be in flight and it is left alone
+  if (status & TIOCPKT_FLUSHREAD && !use_uring)
+    drop_pending(from);
+
+  if (status & TIOCPKT_IOCTL)
+    termios_changed(from);
+
+  // TIOCPKT_FLUSHWRITE: nothing from the slave is held here, it is only
+  // read once its peer took the previous chunk; TIOCPKT_STOP and
+  // TIOCPKT_START: XON/XOFF cross the bridge as data and need no help
+  return 0;
+}
+
+/*
+ * Move data from one end to the other until from runs dry or the other
+ * end is full. In the latter case the rest waits in the other end's buffer
+ * and its EPOLLOUT resumes the copy, so nothing is read that cannot be
+ * written.
+ */
+void
+copydata(struct end *from)
+{
+  struct end *to = from->peer;
+  struct itimerspec its;
+  size_t want;
+  ssize_t br;
+
+  while (to->len == 0 && to->piped == 0)
+  {
+    // the status byte of packet mode does not take line time
+    want = pace_budget(from, to->rsize - use_packet) + use_packet;
+    if (want == (size_t) use_packet)
+    {
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_nsec = pace_delay(from);
+      timerfd_settime(from->timerfd, 0, &its, NULL);
+      return;
+    }
+
+    if (from->w->splice)
+      br = splice_in(from, to);
     else
+      br = read(from->fd, to->buffer, want);
+    if (br < 0)
     {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EIO)
+        return;
       perror("read");
       exit(1);
     }
+    if (br == 0)
+      return;
+
+    adapt_rsize(to, br);
+    if (from->w->splice)
+    {
+      to->piped = br;
+    }
+    else if (use_packet)
+    {
+      to->head = 1;
+      to->len = take_packet(from, br);
+    }
+    else
+    {
+      to->head = 0;
+      to->len = br;
+    }
+    if (use_pacing)
+      pace_charge(from, to->len);
+    if (!flush_pending(to))
+    {
+      set_events(to, EPOLLIN | EPOLLOUT);
+      return;
+    }
+  }
+}
+
+/* the pty of e drained, finish what is pending and take more from its peer */
+void
+resume(struct end *e)
+{
+  if (!flush_pending(e))
+    return;
+  set_events(e, EPOLLIN);
+  copydata(e->peer);
+}
+
+static struct end *ends;
+static int nends;
+
+/* open both ptys of a new pair, linking them to name1 and name2 if given */
+int
+add_pair(const char *name1, const char *name2, long weight)
+{
+  struct end *e;
+
+  ends = realloc(ends, (nends + 2) * sizeof(*ends));
+  if (ends == NULL)
+  {
+    perror("realloc");
+    return -1;
   }
-  if (br > 0)
+  e = &ends[nends];
+  e[0].len = e[1].len = 0;
+  e[0].weight = e[1].weight = weight;
+
+  e[0].fd = ptym_open(e[0].master, e[0].slave, 1024);
+  e[1].fd = ptym_open(e[1].master, e[1].slave, 1024);
+  if (e[0].fd < 0 || e[1].fd < 0)
   {
-    do
+    fprintf(stderr, "Cannot open a pseudo-tty\n");
+    return -1;
+  }
+
+  if (name1 != NULL && name2 != NULL)
+  {
+    unlink(name1);
+    unlink(name2);
+    if (symlink(e[0].slave, name1) < 0)
     {
-      do
-      {
-        bw = write(fdto, pbuf, br);
-        if (bw > 0)
-        {
-          pbuf += bw;
-          br -= bw;
-        }
-      } while (br > 0 && bw > 0);
-    } while (bw < 0 && errno == EAGAIN);
-    if (bw <= 0)
-    {
-      // kernel buffer may be full, but we can recover
-      fprintf(stderr, "Write error, br=%d bw=%d\n", (int) br, (int) bw);
-      usleep(500000);
-      // discard input
-      while (read(fdfrom, buffer, 1024) > 0)
-        ;
+      fprintf(stderr, "Cannot create: %s\n", name1);
+      return -1;
+    }
+    if (symlink(e[1].slave, name2) < 0)
+    {
+      fprintf(stderr, "Cannot create: %s\n", name2);
+      return -1;
     }
+    printf("(%s) <=> (%s)\n", name1, name2);
   }
   else
   {
-    usleep(100000);
+    printf("(%s) <=> (%s)\n", e[0].slave, e[1].slave);
   }
+
+  conf_ser(e[0].fd);
+  conf_ser(e[1].fd);
+
+  nends += 2;
+  return 0;
 }
 
-int main(int argc, char* argv[])
+/*
+ * one pair per line, two link names separated by blanks and optionally
+ * the weight of the pair for sharing out the pairs among the workers,
+ * # comments
+ */
+int
+read_config(const char *file)
 {
-  char master1[1024];
-  char slave1[1024];
-  char master2[1024];
-  char slave2[1024];
+  char line[4096];
+  char name1[1024], name2[1024];
+  long weight;
+  FILE *f;
+  int n;
 
-  int fd1;
-  int fd2;
+  f = fopen(file, "r");
+  if (f == NULL)
+  {
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if (strchr(line, '#'))
+      *strchr(line, '#') = '\0';
+    weight = 1;
+    n = sscanf(line, "%1023s %1023s %ld", name1, name2, &weight);
+    if (n <= 0)
+      continue;
+    if (n < 2 || weight < 0 || add_pair(name1, name2, weight) < 0)
+    {
+      fprintf(stderr, "%s: bad pair: %s", file, line);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  return 0;
+}
 
-  fd_set rfds;
-  int retval;
+/*
+ * io_uring engine: every end has a poll linked to a read posted while its
+ * peer's buffer is empty, and a write posted while its own buffer holds
+ * data. Completions of all pairs are handled in one go and everything
+ * they queue is submitted with the next io_uring_enter.
+ */
+#define OP_POLL  0
+#define OP_READ  1
+#define OP_WRITE 2
+#define OP_RETRY 3
+#define OP_MASK  3
+
+/*
+ * A master reads EIO while nobody has the slave open, and polls as
+ * readable, so there is nothing to wait on. It is read again after 1 ms,
+ * twice as long after each further miss up to 1 s, so an idle pty costs
+ * a wakeup a second and a program opening it waits up to that long for
+ * its first data to be passed on.
+ */
+#define RETRY_MIN_NS 1000000LL
+#define RETRY_MAX_NS 1000000000LL
 
-  fd1=ptym_open(master1,slave1,1024);
+/*
+ * Make room for n entries and return the first; the others can be taken
+ * with uring_get_sqe. A submit can take only part of the queue, or none
+ * of it while the kernel has no room for completions, so it is repeated,
+ * and the completions are moved to the backlog of w to make room.
+ */
+struct io_uring_sqe *
+get_sqes(struct worker *w, unsigned n)
+{
+  struct io_uring_cqe *cqe;
+  int ret;
+
+  while (uring_space(&w->ring) < n)
+  {
+    ret = uring_submit(&w->ring, 0);
+    if (ret > 0)
+      continue;
+    if (ret == 0 || (errno != EBUSY && errno != EAGAIN))
+    {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    while ((cqe = uring_peek_cqe(&w->ring)) != NULL)
+    {
+      w->backlog[w->backlog_tail++ % w->backlog_size] = *cqe;
+      uring_cqe_seen(&w->ring);
+    }
+  }
+  return uring_get_sqe(&w->ring);
+}
 
-  fd2=ptym_open(master2,slave2,1024);
+void uring_timeout(struct end *from, struct __kernel_timespec *ts);
 
-  if (argc >= 3)
+/* read from the pty of from into its peer's buffer once it is readable */
+void
+uring_read(struct end *from)
+{
+  struct end *to = from->peer;
+  struct io_uring_sqe *sqe;
+  size_t want;
+
+  want = pace_budget(from, to->rsize - use_packet) + use_packet;
+  if (want == (size_t) use_packet)
   {
-    unlink(argv[1]);
-    unlink(argv[2]);
-    if (symlink(slave1, argv[1]) < 0)
-	{
-      fprintf(stderr, "Cannot create: %s\n", argv[1]);
-      return 1;
+    from->pace_ts.tv_sec = 0;
+    from->pace_ts.tv_nsec = pace_delay(from);
+    uring_timeout(from, &from->pace_ts);
+    return;
+  }
+
+  sqe = get_sqes(from->w, 2);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = from->fd;
+  sqe->poll32_events = POLLIN;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = (unsigned long) from | OP_POLL;
+
+  sqe = uring_get_sqe(&from->w->ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = from->fd;
+  sqe->addr = (unsigned long) to->buffer;
+  sqe->len = want;
+  sqe->user_data = (unsigned long) from | OP_READ;
+}
+
+/* write the buffer of to, waiting for room if the pty is full */
+void
+uring_write(struct end *to, int wait)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqes(to->w, 2);
+  if (wait)
+  {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = to->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (unsigned long) to | OP_POLL;
+    sqe = uring_get_sqe(&to->w->ring);
+  }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = to->fd;
+  sqe->addr = (unsigned long) (to->buffer + to->head);
+  sqe->len = to->len;
+  sqe->user_data = (unsigned long) to | OP_WRITE;
+}
+
+/* read from again after ts */
+void
+uring_timeout(struct end *from, struct __kernel_timespec *ts)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = get_sqes(from->w, 1);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long) ts;
+  sqe->len = 1;
+  sqe->user_data = (unsigned long) from | OP_RETRY;
+}
+
+void
+uring_complete(struct end *e, int op, int res)
+{
+  switch (op)
+  {
+  case OP_READ:
+    // e is the end read from
+    if (res > 0)
+    {
+      e->retry_ns = 0;
+      adapt_rsize(e->peer, res);
+      e->peer->head = use_packet ? 1 : 0;
+      e->peer->len = use_packet ? take_packet(e, res) : res;
+      if (use_pacing)
+        pace_charge(e, e->peer->len);
+      if (e->peer->len > 0)
+        uring_write(e->peer, 0);
+      else
+        uring_read(e);
     }
-    if (symlink(slave2, argv[2]) < 0) {
-      fprintf(stderr, "Cannot create: %s\n", argv[2]);
-      return 1;
+    else if (res == 0 || res == -EIO)
+    {
+      e->retry_ns = e->retry_ns ? e->retry_ns * 2 : RETRY_MIN_NS;
+      if (e->retry_ns > RETRY_MAX_NS)
+        e->retry_ns = RETRY_MAX_NS;
+      e->retry_ts.tv_sec = e->retry_ns / 1000000000LL;
+      e->retry_ts.tv_nsec = e->retry_ns % 1000000000LL;
+      uring_timeout(e, &e->retry_ts);
     }
-    printf("(%s) <=> (%s)\n",argv[1],argv[2]);
+    else if (res == -EAGAIN || res == -EINTR || res == -ECANCELED)
+      uring_read(e);
+    else
+    {
+      fprintf(stderr, "read: %s\n", strerror(-res));
+      exit(1);
+    }
+    break;
+  case OP_WRITE:
+    // e is the end written to
+    if (res > 0)
+    {
+      e->head += res;
+      e->len -= res;
+    }
+    else if (res == -EAGAIN || res == -EINTR || res == -ECANCELED)
+    {
+      uring_write(e, 1);
+      break;
+    }
+    else
+    {
+      // nobody will ever take it
+      fprintf(stderr, "Write error on %s: %s\n", e->slave, strerror(-res));
+      e->len = 0;
+    }
+    if (e->len > 0)
+      uring_write(e, 1);
+    else
+      uring_read(e->peer);
+    break;
+  case OP_RETRY:
+    uring_read(e);
+    break;
   }
-  else {
-    printf("(%s) <=> (%s)\n",slave1,slave2);
+}
+
+/* returns only if io_uring cannot be set up */
+void
+uring_loop(struct worker *w)
+{
+  struct io_uring_cqe *cqe;
+  struct io_uring_cqe done;
+  struct end *e;
+  int i;
+
+  // at most a linked poll and an operation per end and direction
+  if (uring_init(&w->ring, w->nends < 1024 ? 4 * w->nends : 4096) < 0)
+  {
+    perror("io_uring_setup, using epoll");
+    return;
   }
 
-  conf_ser(fd1);
-  conf_ser(fd2);
+  // and so no more completions than that waiting at any time
+  w->backlog_size = 4 * w->nends;
+  w->backlog = malloc(w->backlog_size * sizeof(*w->backlog));
+  if (!w->backlog)
+  {
+    perror("malloc");
+    exit(1);
+  }
 
-  while(1)
+  for (i = 0; i < nends; i++)
   {
-    FD_ZERO(&rfds);
-    FD_SET(fd1, &rfds);
-    FD_SET(fd2, &rfds);
+    if (ends[i].w == w)
+      uring_read(&ends[i]);
+  }
 
-    retval = select(fd2 + 1, &rfds, NULL, NULL, NULL);
+  while (1)
+  {
+    // what get_sqes put aside came first, and it may put more there
+    while (w->backlog_head != w->backlog_tail)
+    {
+      done = w->backlog[w->backlog_head++ % w->backlog_size];
+      e = (struct end *) (unsigned long) (done.user_data & ~OP_MASK);
+      uring_complete(e, done.user_data & OP_MASK, done.res);
+    }
+
+    // busy means completions must be taken first, which happens below
+    if (uring_submit(&w->ring, 1) < 0 && errno != EBUSY && errno != EAGAIN)
+    {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    while ((cqe = uring_peek_cqe(&w->ring)) != NULL)
+    {
+      done = *cqe;
+      uring_cqe_seen(&w->ring);
+      e = (struct end *) (unsigned long) (done.user_data & ~OP_MASK);
+      uring_complete(e, done.user_data & OP_MASK, done.res);
+    }
+  }
+}
+
+void
+epoll_loop(struct worker *w)
+{
+  struct epoll_event ev;
+  struct epoll_event events[64];
+  struct end *e;
+  uint64_t expired;
+  int retval;
+  int i;
+
+  w->epfd = epoll_create1(0);
+  if (w->epfd < 0)
+  {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (i = 0; i < nends; i++)
+  {
+    if (ends[i].w != w)
+      continue;
+    if (w->splice && pipe2(ends[i].pipe, O_NONBLOCK) < 0)
+    {
+      perror("pipe2");
+      exit(1);
+    }
+    // edge triggered, so each wakeup must read until EAGAIN
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &ends[i];
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ends[i].fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      exit(1);
+    }
+    // the pacing timer of an end comes back with the low bit set
+    if (use_pacing)
+    {
+      ev.events = EPOLLIN;
+      ev.data.ptr = (char *) &ends[i] + 1;
+      if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ends[i].timerfd, &ev) < 0)
+      {
+        perror("epoll_ctl");
+        exit(1);
+      }
+    }
+  }
+
+  while(1)
+  {
+    retval = epoll_wait(w->epfd, events, 64, -1);
     if (retval == -1)
     {
-      perror("select");
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (i = 0; i < retval; i++)
+    {
+      e = events[i].data.ptr;
+      if ((unsigned long) e & 1)
+      {
+        e = (struct end *) ((char *) e - 1);
+        if (read(e->timerfd, &expired, sizeof(expired)) > 0)
+          copydata(e);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT)
+        resume(e);
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        copydata(e);
+    }
+  }
+}
+
+void *
+worker_main(void *arg)
+{
+  struct worker *w = arg;
+  cpu_set_t set;
+
+  if (w->cpu >= 0)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      fprintf(stderr, "Cannot pin a worker to cpu %d\n", w->cpu);
+  }
+
+  // io_uring copies through the buffers, it has no splice path
+  if (use_uring)
+    uring_loop(w);
+  epoll_loop(w);
+  return NULL;
+}
+
+/*
+ * Hand out the pairs, heaviest first, each to the worker with the least
+ * load so far; every worker gets the next CPU we are allowed to run on.
+ */
+void
+assign_pairs(struct worker *workers, int nworkers)
+{
+  cpu_set_t set;
+  int cpu = -1;
+  int *order;
+  int i, j, k, best;
+
+  if (nworkers > 1 && sched_getaffinity(0, sizeof(set), &set) == 0)
+  {
+    for (i = 0; i < nworkers; i++)
+    {
+      do
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu, &set));
+      workers[i].cpu = cpu;
+    }
+  }
+
+  order = malloc(nends / 2 * sizeof(*order));
+  for (i = 0; i < nends / 2; i++)
+  {
+    // insertion sort by weight, the list of pairs is short
+    for (j = i; j > 0 && ends[2 * order[j - 1]].weight < ends[2 * i].weight;
+         j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  for (i = 0; i < nends / 2; i++)
+  {
+    k = order[i];
+    best = 0;
+    for (j = 1; j < nworkers; j++)
+    {
+      if (workers[j].load < workers[best].load)
+        best = j;
+    }
+    ends[2 * k].w = ends[2 * k + 1].w = &workers[best];
+    workers[best].load += ends[2 * k].weight;
+    workers[best].nends += 2;
+  }
+  free(order);
+}
+
+void
+usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [-z|-u] [-p] [-r] [-t threads] [-b size[:size]] [-n count] "
+          "[-f file] [link1 link2 ...]\n", name);
+  exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+  struct worker *workers;
+  int nworkers = 1;
+  int count = 0;
+  // buffer of the data going from the first to the second pty and back
+  size_t size_12 = BUFFER_SIZE, size_21 = BUFFER_SIZE;
+  char *next;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "zuprt:b:n:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      size_12 = strtoul(optarg, &next, 0);
+      size_21 = *next == ':' ? strtoul(next + 1, NULL, 0) : size_12;
+      if (size_12 < MIN_BUFFER_SIZE || size_21 < MIN_BUFFER_SIZE)
+      {
+        fprintf(stderr, "buffers need at least %d bytes\n", MIN_BUFFER_SIZE);
+        return 1;
+      }
+      break;
+    case 't':
+      nworkers = atoi(optarg);
+      if (nworkers < 1)
+        usage(argv[0]);
+      break;
+    case 'u':
+      use_uring = 1;
+      break;
+    case 'p':
+      use_packet = 1;
+      break;
+    case 'r':
+      // the line speed is followed through the termios reports
+      use_pacing = 1;
+      use_packet = 1;
+      break;
+    case 'z':
+      use_splice = 1;
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'f':
+      if (read_config(optarg) < 0)
+        return 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ((argc - optind) % 2)
+    usage(argv[0]);
+  if (use_packet && use_splice)
+  {
+    fprintf(stderr, "packet mode needs the data to pass the bridge, no -z\n");
+    return 1;
+  }
+
+  for (i = optind; i < argc; i += 2)
+  {
+    if (add_pair(argv[i], argv[i + 1], 1) < 0)
+      return 1;
+  }
+  for (i = 0; i < count; i++)
+  {
+    if (add_pair(NULL, NULL, 1) < 0)
+      return 1;
+  }
+  // without any pair spec behave as always and serve one unnamed pair
+  if (nends == 0 && add_pair(NULL, NULL, 1) < 0)
+    return 1;
+  fflush(stdout);
+
+  for (i = 0; i < nends; i++)
+  {
+    ends[i].peer = &ends[i ^ 1];
+    ends[i].piped = 0;
+    // the second pty of a pair receives what the first one sends
+    ends[i].size = i % 2 ? size_12 : size_21;
+    ends[i].rsize = ends[i].size < 1024 ? ends[i].size : 1024;
+    ends[i].buffer = malloc(ends[i].size);
+    if (ends[i].buffer == NULL)
+    {
+      perror("malloc");
       return 1;
     }
-    if (FD_ISSET(fd1, &rfds))
+    if (use_packet && set_packet(ends[i].fd) < 0)
     {
-      copydata(fd1, fd2);
+      perror("TIOCPKT");
+      return 1;
     }
-    if (FD_ISSET(fd2, &rfds))
+    if (use_packet)
+      tcgetattr(ends[i].fd, &ends[i].line);
+    if (use_pacing)
     {
-      copydata(fd2, fd1);
+      ends[i].frame_ns = frame_ns(&ends[i].line);
+      ends[i].credit_ns = 0;
+      ends[i].last_ns = now_ns();
+      ends[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+      if (ends[i].timerfd < 0)
+      {
+        perror("timerfd_create");
+        return 1;
+      }
     }
   }
 
-  close(fd1);
-  close(fd2);
+  // no idle workers
+  if (nworkers > nends / 2)
+    nworkers = nends / 2 > 0 ? nends / 2 : 1;
+  workers = calloc(nworkers, sizeof(*workers));
+  for (i = 0; i < nworkers; i++)
+  {
+    workers[i].cpu = -1;
+    workers[i].splice = use_splice;
+  }
+  assign_pairs(workers, nworkers);
+
+  // the main thread is the last worker
+  for (i = 0; i < nworkers - 1; i++)
+  {
+    if (pthread_create(&workers[i].thread, NULL, worker_main,
+                       &workers[i]) != 0)
+    {
+      fprintf(stderr, "Cannot start worker %d\n", i);
+      return 1;
+    }
+  }
+  worker_main(&workers[nworkers - 1]);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,144 @@
+/* ########################################################################
+
+   uring - minimal io_uring rings for the tty0tty pts bridge
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   ######################################################################## */
+
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+int
+uring_init(struct uring *r, unsigned entries)
+{
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return -1;
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size)
+    sq_size = cq_size;
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto err;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    cq = sq;
+  }
+  else
+  {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      goto err;
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto err;
+
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->sq_tail_local = *r->sq_tail;
+
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  return 0;
+
+err:
+  // the mappings go away with the process, the bridge falls back to epoll
+  close(r->fd);
+  return -1;
+}
+
+unsigned
+uring_space(struct uring *r)
+{
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  return *r->sq_mask + 1 - (r->sq_tail_local - head);
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  if (uring_space(r) == 0)
+    return NULL;
+
+  index = r->sq_tail_local & *r->sq_mask;
+  sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  r->sq_tail_local++;
+  r->to_submit++;
+  return sqe;
+}
+
+int
+uring_submit(struct uring *r, unsigned wait)
+{
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+
+  __atomic_store_n(r->sq_tail, r->sq_tail_local, __ATOMIC_RELEASE);
+  do
+  {
+    ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait, flags,
+                  NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret >= 0)
+    r->to_submit -= ret;
+  return ret;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r)
+{
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r)
+{
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
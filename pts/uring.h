@@ -0,0 +1,65 @@
+/* ########################################################################
+
+   uring - minimal io_uring rings for the tty0tty pts bridge
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   Talks to the kernel with the raw system calls, so the bridge does not
+   need liburing.
+
+   ######################################################################## */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+struct uring
+{
+  int fd;
+
+  // submission queue, shared with the kernel
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_tail_local;   // tail of the entries not yet made visible
+  unsigned to_submit;
+
+  // completion queue, shared with the kernel
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+/* returns 0, or -1 with errno set if the kernel has no io_uring */
+int uring_init(struct uring *r, unsigned entries);
+
+/* number of entries that can be queued before the next uring_submit */
+unsigned uring_space(struct uring *r);
+
+/* a cleared entry to fill in, NULL while the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+/* hand all queued entries to the kernel and wait for wait completions */
+int uring_submit(struct uring *r, unsigned wait);
+
+/* the oldest completion, NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+
+/* release the completion returned by uring_peek_cqe */
+void uring_cqe_seen(struct uring *r);
+
+#endif